@@ -7,7 +7,14 @@
 
 #include "XHandler.h"
 
-void XHandler::deliverMessage(shared_ptr<XMessage> msg) {
+XHandler::~XHandler() {
+    shared_ptr<XLooper> looper = mLooper.lock();
+    if (looper != nullptr) {
+        looper->unregisterHandler(this);
+    }
+}
+
+void XHandler::deliverMessage(const shared_ptr<XMessage> &msg) {
     onMessageReceived(msg);
     mMessageCounter++;
 }
@@ -15,13 +15,23 @@
 using namespace std;
 class XMessage;
 
+// Handlers are called through a raw pointer from the looper's handler
+// table. Unregister from the looper at the top of the most derived
+// destructor, before any state onMessageReceived() uses is torn down;
+// ~XHandler() unregisters as a last resort, from the looper the handler was
+// last registered with.
+//
+// The handler only holds its looper weakly. A message keeps a strong
+// reference to its target's looper, so a looper with queued messages stays
+// alive until they are delivered or dropped, even after its owner and
+// handlers have let go of it.
 class XHandler
 {
 public:
     XHandler()
         :mID(0),
          mMessageCounter(0){};
-    virtual ~XHandler(){};
+    virtual ~XHandler();
 
     weak_ptr<XLooper> getLooper() {
         return mLooper;
@@ -49,6 +59,7 @@ protected:
 private:
     friend class XMessage;      // deliverMessage()
     friend class XLooper;
+    template <typename T> friend class XTypedMessage;   // mMessageCounter
 
     XLooper::handler_id mID;
     weak_ptr<XLooper> mLooper;
@@ -60,7 +71,7 @@ private:
     }
 
     uint32_t mMessageCounter;
-    void deliverMessage(shared_ptr<XMessage> msg);
+    void deliverMessage(const shared_ptr<XMessage> &msg);
 };
 
 #endif /* XHandler_hpp */
@@ -0,0 +1,231 @@
+//
+//  XLog.cpp
+//  foundation
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#if defined(__ANDROID__)
+#include <android/log.h>
+#endif
+#include "XLog.h"
+
+namespace {
+
+// Bounded multi-producer ring (Vyukov): a slot's sequence tells whether it
+// is free for the producer holding ticket |pos| (== pos) or holds that
+// producer's line (== pos + 1). The writer is the only consumer.
+struct Slot {
+    atomic<size_t> mSeq;
+    int mLevel;
+    char mTag[XLog::kMaxTagSize];
+    char mText[XLog::kMaxLineSize];
+};
+
+struct Logger {
+    Logger();
+    void writerLoop();
+    bool hasPublished() const;
+    size_t drain();
+    void emit(int level, const char *tag, const char *text);
+
+    Slot mSlots[XLog::kRingSize];
+    atomic<size_t> mEnqueuePos;
+    atomic<size_t> mDequeuePos;
+    atomic<uint32_t> mDropped;
+    atomic<int> mLevel;
+
+    mutex mLock;
+    // the writer sleeps on it; producers only signal when it is asleep,
+    // under mLock so the signal can't fall between its check and its wait
+    condition_variable mWakeCondition;
+    condition_variable mDrainedCondition;
+    atomic<bool> mWriterSleeping;
+    uint32_t mFlushWaiters;
+    XLog::Sink mSink;
+};
+
+Logger::Logger()
+    : mEnqueuePos(0),
+      mDequeuePos(0),
+      mDropped(0),
+      mLevel(XLog::kLevelVerbose),
+      mWriterSleeping(false),
+      mFlushWaiters(0) {
+    for (size_t i = 0; i < XLog::kRingSize; ++i) {
+        mSlots[i].mSeq.store(i, memory_order_relaxed);
+    }
+}
+
+void defaultSink(int level, const char *tag, const char *text) {
+#if defined(__ANDROID__)
+    __android_log_write(level, tag, text);
+#else
+    static const char kLetters[] = "??VDIWE";
+    char letter = (level >= XLog::kLevelVerbose && level <= XLog::kLevelError)
+            ? kLetters[level] : '?';
+    fprintf(stdout, "%c/%s: %s\n", letter, tag, text);
+#endif
+}
+
+void Logger::emit(int level, const char *tag, const char *text) {
+    if (mSink) {
+        mSink(level, tag, text);
+    } else {
+        defaultSink(level, tag, text);
+    }
+}
+
+// Hands every published line to the sink, returns how many there were.
+size_t Logger::drain() {
+    size_t count = 0;
+    lock_guard<mutex> autoLock(mLock);
+    size_t pos = mDequeuePos.load(memory_order_relaxed);
+    for (;;) {
+        Slot &slot = mSlots[pos & (XLog::kRingSize - 1)];
+        if (slot.mSeq.load(memory_order_acquire) != pos + 1) {
+            break;
+        }
+        emit(slot.mLevel, slot.mTag, slot.mText);
+        slot.mSeq.store(pos + XLog::kRingSize, memory_order_release);
+        mDequeuePos.store(++pos, memory_order_release);
+        ++count;
+    }
+
+    uint32_t dropped = mDropped.exchange(0);
+    if (dropped > 0) {
+        char text[64];
+        snprintf(text, sizeof(text), "%u lines dropped, log ring full", dropped);
+        emit(XLog::kLevelWarn, "XLog", text);
+    }
+    if (count > 0 || dropped > 0) {
+        if (!mSink) {
+            fflush(stdout);
+        }
+        if (mFlushWaiters > 0) {
+            mDrainedCondition.notify_all();
+        }
+    }
+    return count;
+}
+
+// Whether the next line is published. Sequentially consistent, paired with
+// the producer's publishing store and its mWriterSleeping load: either the
+// writer sees the line or the producer sees the writer asleep.
+bool Logger::hasPublished() const {
+    size_t pos = mDequeuePos.load();
+    return mSlots[pos & (XLog::kRingSize - 1)].mSeq.load() == pos + 1;
+}
+
+void Logger::writerLoop() {
+    for (;;) {
+        if (drain() > 0) {
+            continue;
+        }
+
+        unique_lock<mutex> autoLock(mLock);
+        mWriterSleeping.store(true);
+        mWakeCondition.wait(autoLock, [this] { return hasPublished(); });
+        mWriterSleeping.store(false);
+    }
+}
+
+// Never destroyed: loopers may still log while static destructors run.
+Logger *sLogger;
+once_flag sLoggerOnce;
+
+void flushAtExit() {
+    XLog::flush();
+}
+
+Logger *logger() {
+    call_once(sLoggerOnce, [] {
+        sLogger = new Logger();
+        thread(&Logger::writerLoop, sLogger).detach();
+        atexit(flushAtExit);
+    });
+    return sLogger;
+}
+
+}  // namespace
+
+void XLog::setSink(Sink sink) {
+    Logger *l = logger();
+    lock_guard<mutex> autoLock(l->mLock);
+    l->mSink = sink;
+}
+
+void XLog::setLevel(int level) {
+    logger()->mLevel.store(level, memory_order_relaxed);
+}
+
+bool XLog::isLoggable(int level) {
+    return level >= logger()->mLevel.load(memory_order_relaxed);
+}
+
+void XLog::flush() {
+    Logger *l = logger();
+    size_t target = l->mEnqueuePos.load();
+    unique_lock<mutex> autoLock(l->mLock);
+    ++l->mFlushWaiters;
+    l->mWakeCondition.notify_one();
+    // a line claimed but not yet published holds the writer up; bound the
+    // wait so a producer stuck mid-format can't hang exit
+    chrono::steady_clock::time_point deadline =
+            chrono::steady_clock::now() + chrono::seconds(1);
+    while (l->mDequeuePos.load() < target) {
+        if (l->mDrainedCondition.wait_until(autoLock, deadline) == cv_status::timeout) {
+            break;
+        }
+    }
+    --l->mFlushWaiters;
+}
+
+void XLog::write(int level, const char *tag, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vwrite(level, tag, fmt, args);
+    va_end(args);
+}
+
+void XLog::vwrite(int level, const char *tag, const char *fmt, va_list args) {
+    Logger *l = logger();
+    size_t pos = l->mEnqueuePos.load(memory_order_relaxed);
+    Slot *slot;
+    for (;;) {
+        slot = &l->mSlots[pos & (kRingSize - 1)];
+        size_t seq = slot->mSeq.load(memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (l->mEnqueuePos.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            l->mDropped.fetch_add(1, memory_order_relaxed);
+            return;
+        } else {
+            pos = l->mEnqueuePos.load(memory_order_relaxed);
+        }
+    }
+
+    slot->mLevel = level;
+    snprintf(slot->mTag, sizeof(slot->mTag), "%s", tag != NULL ? tag : "");
+    int len = vsnprintf(slot->mText, sizeof(slot->mText), fmt, args);
+    // callers carried over from printf may still end lines with a newline
+    if (len > 0 && (size_t)len < sizeof(slot->mText) && slot->mText[len - 1] == '\n') {
+        slot->mText[len - 1] = '\0';
+    }
+    // sequentially consistent with the load below, see hasPublished()
+    slot->mSeq.store(pos + 1);
+
+    if (l->mWriterSleeping.load()) {
+        lock_guard<mutex> autoLock(l->mLock);
+        l->mWakeCondition.notify_one();
+    }
+}
@@ -0,0 +1,96 @@
+//
+//  XLog.hpp
+//  foundation
+//
+
+#ifndef XLog_hpp
+#define XLog_hpp
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <functional>
+
+using namespace std;
+
+// Leveled logging for the library, used through the XLOGx macros:
+//
+//     #define LOG_TAG "MediaClock"
+//     #include "XLog.h"
+//     XLOGD("post %d", what);
+//
+// Include it from .cpp files only, after defining LOG_TAG. Levels below
+// XLOG_MIN_LEVEL are compiled out, arguments included; pass
+// -DXLOG_MIN_LEVEL=2 to keep verbose logs. By default debug logs are kept
+// unless NDEBUG is defined.
+//
+// Callers only format the line into a lock-free ring buffer; a background
+// thread hands it to the sink, so logging never does I/O or takes a lock on
+// the calling thread. When the ring is full lines are dropped and counted,
+// and the writer reports how many were lost.
+class XLog
+{
+public:
+    // same values as android_LogPriority
+    enum Level {
+        kLevelVerbose = 2,
+        kLevelDebug,
+        kLevelInfo,
+        kLevelWarn,
+        kLevelError,
+    };
+
+    enum {
+        kRingSize = 1024,       // lines, a power of two
+        kMaxTagSize = 32,
+        kMaxLineSize = 256,     // longer lines are truncated
+    };
+
+    // Called on the writer thread, one line at a time without a trailing
+    // newline. Must not log or call setSink().
+    typedef function<void(int level, const char *tag, const char *text)> Sink;
+
+    // nullptr restores the default sink: logcat on Android, stdout elsewhere.
+    static void setSink(Sink sink);
+
+    // Runtime threshold on top of XLOG_MIN_LEVEL.
+    static void setLevel(int level);
+    static bool isLoggable(int level);
+
+    // Blocks until every line logged before the call has reached the sink.
+    // Also run at exit.
+    static void flush();
+
+    static void write(int level, const char *tag, const char *fmt, ...)
+#if defined(__GNUC__)
+        __attribute__((format(printf, 3, 4)))
+#endif
+        ;
+    static void vwrite(int level, const char *tag, const char *fmt, va_list args);
+};
+
+#ifndef LOG_TAG
+#define LOG_TAG "XLooper"
+#endif
+
+#ifndef XLOG_MIN_LEVEL
+#ifdef NDEBUG
+#define XLOG_MIN_LEVEL 4
+#else
+#define XLOG_MIN_LEVEL 3
+#endif
+#endif
+
+#define XLOG_PRI(level, ...) \
+    do { \
+        if ((level) >= XLOG_MIN_LEVEL && XLog::isLoggable(level)) { \
+            XLog::write((level), LOG_TAG, __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define XLOGV(...) XLOG_PRI(XLog::kLevelVerbose, __VA_ARGS__)
+#define XLOGD(...) XLOG_PRI(XLog::kLevelDebug, __VA_ARGS__)
+#define XLOGI(...) XLOG_PRI(XLog::kLevelInfo, __VA_ARGS__)
+#define XLOGW(...) XLOG_PRI(XLog::kLevelWarn, __VA_ARGS__)
+#define XLOGE(...) XLOG_PRI(XLog::kLevelError, __VA_ARGS__)
+
+#endif /* XLog_hpp */
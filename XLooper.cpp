@@ -4,13 +4,22 @@
 //
 //  Created by xuwei on 9/22/21.
 //
-#include <iostream>
+#define LOG_TAG "XLooper"
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__linux__) || defined(__APPLE__)
+#include <pthread.h>
+#endif
 #include "XLooper.h"
 #include "XHandler.h"
+#include "XLooperRecorder.h"
+#include "XLog.h"
 
 
-static XLooper::handler_id mNextHandlerID = 1;
-
 int64_t XLooper::GetNowUs() {
     auto now = chrono::steady_clock::now();
     return now.time_since_epoch().count()/1000ll;
@@ -24,10 +33,81 @@ shared_ptr<XLooper> XLooper::createLooper()
     return slooper;
 }
 
+XLooper::QueueLimits::QueueLimits()
+    : mMaxMessages(0),
+      mMaxBytes(0),
+      mPolicy(kOverflowReject),
+      mBlockTimeoutUs(0),
+      mHighMessages(0),
+      mLowMessages(0),
+      mHighBytes(0),
+      mLowBytes(0) {
+}
+
+XLooper::QueueAccount::QueueAccount()
+    : mMessages(0),
+      mBytes(0),
+      mAboveHigh(false) {
+}
+
+XLooper::ThreadConfig::ThreadConfig()
+    : mPolicy(kSchedDefault),
+      mPriority(0),
+      mNumaNode(-1) {
+}
+
+XLooper::Event::Event()
+    : mWhenUs(0),
+      mDeadlineUs(INT64_MAX),
+      mPriority(kPriorityNormal),
+      mHandlerID(0),
+      mBytes(0),
+      mPeriodUs(0),
+      mPeriodicPolicy(kPeriodicSkip),
+      mTimeline(0),
+      mSeq(0),
+      mDueIndex(SIZE_MAX) {
+}
+
+XLooper::Timeline::Timeline()
+    : mAnchorMediaUs(0),
+      mAnchorRealUs(-1),
+      mRate(1.0),
+      mMaxMediaUs(INT64_MAX) {
+}
+
+XLooper::DeadlineStats::DeadlineStats()
+    : mMessages(0),
+      mMissed(0),
+      mDropped(0),
+      mMaxLateUs(0) {
+}
+
+XLooper::ThreadState::ThreadState()
+    : mExitPending(false),
+      mRunning(true),
+      mConfigured(false) {
+}
+
 XLooper::XLooper()
 {
-    mThreadRun = false;
-    mExitPending = false;
+    mTrackBytes = false;
+    mBlockedPosters = 0;
+    mDeliveringID = 0;
+    mUnregisterWaiters = 0;
+    mNextIdleHandlerID = 0;
+    mIdleResumeID = 0;
+    mNextTimelineID = 0;
+    mIdlePending = false;
+    mCurrentPeriodic = NULL;
+    mPolling = false;
+    mWakeRequested = false;
+    mNextSeq = 0;
+    for (int i = 0; i < kPriorityCount; ++i) {
+        mLaneBypassCount[i] = 0;
+        mFirstPending[i] = mEventQueue[i].end();
+        mPromotedUs[i] = INT64_MIN;
+    }
 }
 
 XLooper::~XLooper()
@@ -39,143 +119,1320 @@ void XLooper::setName(const char *name) {
     mName = name;
 }
 
+XLooper::handler_id XLooper::makeHandlerID(uint32_t slot, uint32_t generation) {
+    return (handler_id)(((generation & kHandlerGenerationMask) << kHandlerSlotBits) | (slot + 1));
+}
+
+XHandler *XLooper::findHandler_l(handler_id id) const {
+    uint32_t slot = ((uint32_t)id & ((1u << kHandlerSlotBits) - 1)) - 1;
+    if (id <= 0 || slot >= mHandlers.size()) {
+        return NULL;
+    }
+    const HandlerSlot &entry = mHandlers[slot];
+    if (makeHandlerID(slot, entry.mGeneration) != id) {
+        return NULL;
+    }
+    return entry.mHandler;
+}
+
 XLooper::handler_id XLooper::registerHandler(XHandler *handler)
 {
+    if (handler != NULL) {
+        // ~XHandler() only unregisters from its current looper, don't leave
+        // the handler in the previous looper's table
+        shared_ptr<XLooper> previous = handler->mLooper.lock();
+        if (previous != nullptr && previous.get() != this) {
+            previous->unregisterHandler(handler);
+        }
+    }
+
     lock_guard<mutex> autoLock(mLock);
     if(handler != NULL)
     {
-        XLooper::handler_id handlerID = mNextHandlerID++;
+        if (findHandler_l(handler->id()) == handler) {
+            return handler->id();
+        }
+
+        uint32_t slot;
+        if (!mFreeHandlerSlots.empty()) {
+            slot = mFreeHandlerSlots.back();
+            mFreeHandlerSlots.pop_back();
+        } else if (mHandlers.size() < (1u << kHandlerSlotBits) - 1) {
+            slot = (uint32_t)mHandlers.size();
+            HandlerSlot entry;
+            entry.mHandler = NULL;
+            entry.mGeneration = 0;
+            mHandlers.push_back(entry);
+        } else {
+            XLOGE("too many handlers!");
+            return 0;
+        }
+
+        mHandlers[slot].mHandler = handler;
+        XLooper::handler_id handlerID = makeHandlerID(slot, mHandlers[slot].mGeneration);
         handler->setID(handlerID, mLooper.lock());
         return handlerID;
     }
     return 0;
 }
 
+void XLooper::purgeHandler_l(list<Event> &queue, handler_id id,
+        list<Event> &purged, WatermarkCalls &calls) {
+    list<Event>::iterator it = queue.begin();
+    while (it != queue.end()) {
+        list<Event>::iterator next = it;
+        ++next;
+        if (it->mMessage != nullptr && it->mFanout == nullptr
+                && it->mMessage->mTarget == id) {
+            account_l(*it, false, calls);
+            purged.splice(purged.end(), queue, it);
+        }
+        it = next;
+    }
+}
+
 void XLooper::unregisterHandler(XHandler *handler)
 {
-    lock_guard<mutex> autoLock(mLock);
-    if(handler != NULL)
+    // destroyed once mLock is released
+    list<Event> purged;
+    WatermarkCalls calls;
     {
-        //weak_ptr<XLooper> wp;
+        unique_lock<mutex> autoLock(mLock);
+        if (handler == NULL) {
+            return;
+        }
+
+        handler_id id = handler->id();
+        if (findHandler_l(id) != handler) {
+            return;
+        }
+
+        uint32_t slot = ((uint32_t)id & ((1u << kHandlerSlotBits) - 1)) - 1;
+        mHandlers[slot].mHandler = NULL;
+        mHandlers[slot].mGeneration++;
+        mFreeHandlerSlots.push_back(slot);
         handler->setID(0, (shared_ptr<XLooper>)nullptr);
+
+        // drop whatever is still queued for it
+        for (int lane = 0; lane < kPriorityCount; ++lane) {
+            purgeHandler_l(mEventQueue[lane], id, purged, calls);
+        }
+        for (map<timeline_id, Timeline>::iterator it = mTimelines.begin();
+                it != mTimelines.end(); ++it) {
+            purgeHandler_l(it->second.mEvents, id, purged, calls);
+        }
+        mHandlerAccounts.erase(id);
+
+        // the handler may go away as soon as we return, wait for a delivery
+        // in progress on the looper thread
+        if (this_thread::get_id() != mThreadID) {
+            ++mUnregisterWaiters;
+            while (mDeliveringID.load() == id) {
+                mDeliveryDoneCondition.wait(autoLock);
+            }
+            --mUnregisterWaiters;
+        }
+    }
+
+    for (size_t i = 0; i < calls.size(); ++i) {
+        calls[i].first(calls[i].second);
+    }
+}
+
+void XLooper::setThreadConfig(const ThreadConfig &config) {
+    lock_guard<mutex> autoLock(mLock);
+    mThreadConfig = config;
+}
+
+int XLooper::getThreadConfig(ThreadConfig *config) {
+    shared_ptr<ThreadState> state;
+    {
+        lock_guard<mutex> autoLock(mLock);
+        state = mThreadState;
     }
-    return;
+    if (state == nullptr || config == NULL) {
+        return -1;
+    }
+    lock_guard<mutex> autoLock(state->mLock);
+    *config = state->mConfig;
+    return 0;
 }
 
-void XLooper::thread_func()
+#if defined(__linux__)
+#ifndef MPOL_DEFAULT
+#define MPOL_DEFAULT 0
+#define MPOL_PREFERRED 1
+#endif
+
+// Applies |wanted| to the calling thread and returns what actually took.
+static XLooper::ThreadConfig applyThreadConfig(
+        const string &name, const XLooper::ThreadConfig &wanted) {
+    XLooper::ThreadConfig effective;
+    if (!name.empty()) {
+        // the kernel keeps at most 15 characters
+        pthread_setname_np(pthread_self(), name.substr(0, 15).c_str());
+    }
+
+    if (!wanted.mCpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (size_t i = 0; i < wanted.mCpus.size(); ++i) {
+            if (wanted.mCpus[i] >= 0 && wanted.mCpus[i] < CPU_SETSIZE) {
+                CPU_SET(wanted.mCpus[i], &set);
+            }
+        }
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            XLOGW("%s: failed to set cpu affinity", name.c_str());
+        }
+    }
+
+    if (wanted.mPolicy == XLooper::kSchedDefault) {
+        if (wanted.mPriority != 0
+                && setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), wanted.mPriority) != 0) {
+            XLOGW("%s: failed to set nice %d", name.c_str(), wanted.mPriority);
+        }
+    } else {
+        struct sched_param param;
+        param.sched_priority = wanted.mPriority;
+        int policy = wanted.mPolicy == XLooper::kSchedFifo ? SCHED_FIFO : SCHED_RR;
+        if (pthread_setschedparam(pthread_self(), policy, &param) != 0) {
+            XLOGW("%s: failed to set RT priority %d", name.c_str(), wanted.mPriority);
+        }
+    }
+
+#if defined(SYS_set_mempolicy)
+    if (wanted.mNumaNode >= 0 && wanted.mNumaNode < (int)(sizeof(unsigned long) * 8)) {
+        unsigned long nodemask = 1ul << wanted.mNumaNode;
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask,
+                sizeof(nodemask) * 8) == 0) {
+            effective.mNumaNode = wanted.mNumaNode;
+        } else {
+            XLOGW("%s: failed to prefer numa node %d",
+                    name.c_str(), wanted.mNumaNode);
+        }
+    }
+#endif
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        int online = (int)sysconf(_SC_NPROCESSORS_CONF);
+        if (CPU_COUNT(&set) < online) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+                if (CPU_ISSET(cpu, &set)) {
+                    effective.mCpus.push_back(cpu);
+                }
+            }
+        }
+    }
+
+    int policy;
+    struct sched_param param;
+    if (pthread_getschedparam(pthread_self(), &policy, &param) == 0) {
+        if (policy == SCHED_FIFO || policy == SCHED_RR) {
+            effective.mPolicy = policy == SCHED_FIFO
+                ? XLooper::kSchedFifo : XLooper::kSchedRoundRobin;
+            effective.mPriority = param.sched_priority;
+        } else {
+            effective.mPriority = getpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid));
+        }
+    }
+    return effective;
+}
+#else
+static XLooper::ThreadConfig applyThreadConfig(
+        const string &name, const XLooper::ThreadConfig &) {
+#if defined(__APPLE__)
+    if (!name.empty()) {
+        pthread_setname_np(name.c_str());
+    }
+#endif
+    return XLooper::ThreadConfig();
+}
+#endif
+
+void XLooper::thread_func(shared_ptr<ThreadState> state, string name, ThreadConfig config)
 {
-    thread::id id = this_thread::get_id();
-    std::cout <<"start thread id = " << id << endl;
+    XLOGD("%s: looper thread started", name.c_str());
 
-    while(!mExitPending)
     {
-        loop();
+        ThreadConfig effective = applyThreadConfig(name, config);
+        lock_guard<mutex> autoLock(state->mLock);
+        state->mConfig = effective;
+        state->mConfigured = true;
+        state->mCondition.notify_all();
     }
-    unique_lock<mutex> autoLock(mExitLock);
-    mExitPending = true;
-    mThreadRun = false;
-    mThreadExitedCondition.notify_all();
-    std::cout <<"exit thread id = " << id << endl;
+
+    // |state| is checked rather than members: when the last reference to
+    // the looper goes away on this thread, stop() only flags the exit and
+    // the looper is gone by the time loop() returns.
+    while(!state->mExitPending.load())
+    {
+        loop(INT64_MAX, INT64_MAX);
+    }
+    XLOGD("%s: looper thread exiting", name.c_str());
+
+    lock_guard<mutex> autoLock(state->mLock);
+    state->mRunning = false;
+    state->mCondition.notify_all();
 }
 
 int XLooper::start()
 {
-    lock_guard<mutex> autoLock(mLock);
+    shared_ptr<ThreadState> state;
+    {
+        lock_guard<mutex> autoLock(mLock);
 
-    if (mThreadRun != false) {
-        return -1;
-    }
-    mExitPending = false;
-    mThreadRun = true;
+        if (mThreadState != nullptr || mPolling) {
+            return -1;
+        }
+        mThreadState = state = make_shared<ThreadState>();
 
-    mThread = thread(&XLooper::thread_func, this);
-    mThread.detach();
+        mThread = thread(&XLooper::thread_func, this, state, mName, mThreadConfig);
+        mThreadID = mThread.get_id();
+        mThread.detach();
+    }
 
+    // make the placement observable as soon as start() returns
+    unique_lock<mutex> autoLock(state->mLock);
+    while (!state->mConfigured) {
+        state->mCondition.wait(autoLock);
+    }
     return 0;
 }
 
 int XLooper::stop()
 {
-    if(mThreadRun == false)
+    shared_ptr<ThreadState> state;
     {
-        printf("XLooper exit already!\n");
-        return -1;
+        lock_guard<mutex> autoLock(mLock);
+        state.swap(mThreadState);
+        if (state == nullptr) {
+            XLOGV("looper %p exited already", this);
+            return -1;
+        }
+        state->mExitPending.store(true);
+        mQueueChangedCondition.notify_all();
+        if (this_thread::get_id() == mThreadID) {
+            // called while handling an event, the thread exits after it
+            mThreadID = thread::id();
+            return 0;
+        }
+        mThreadID = thread::id();
     }
 
-    mQueueChangedCondition.notify_all();
     {
-        unique_lock<mutex> autoLock(mExitLock);
-        mExitPending = true;
-        while(mThreadRun == true) {
-            mThreadExitedCondition.wait(autoLock);
+        unique_lock<mutex> autoLock(state->mLock);
+        while (state->mRunning) {
+            state->mCondition.wait(autoLock);
         }
-        mExitPending = false;
     }
 
-    printf("XLooper %p stoped!\n", this);
+    XLOGD("looper %p stopped", this);
     return 0;
 }
 
-void XLooper::post(shared_ptr<XMessage> msg, int64_t delayUs) {
+int64_t XLooper::nowUs() {
     lock_guard<mutex> autoLock(mLock);
+    return nowUs_l();
+}
 
-    int64_t whenUs;
+int64_t XLooper::nowUs_l() {
+    return mTimeSource != nullptr ? mTimeSource->nowUs() : GetNowUs();
+}
+
+void XLooper::setTimeSource(shared_ptr<XTimeSource> timeSource) {
+    lock_guard<mutex> autoLock(mLock);
+    mTimeSource = timeSource;
+    mQueueChangedCondition.notify_all();
+}
+
+int64_t XLooper::delayToWhenUs_l(int64_t delayUs) {
+    int64_t nowUs = nowUs_l();
     if (delayUs > 0) {
-        int64_t nowUs = GetNowUs();
-        whenUs = (delayUs > INT64_MAX - nowUs ? INT64_MAX : nowUs + delayUs);
+        return (delayUs > INT64_MAX - nowUs ? INT64_MAX : nowUs + delayUs);
+    }
+    return nowUs;
+}
 
-    } else {
-        whenUs = GetNowUs();
+bool XLooper::beginPoll() {
+    lock_guard<mutex> autoLock(mLock);
+    if (mThreadState != nullptr || mPolling) {
+        return false;
+    }
+    mPolling = true;
+    mThreadID = this_thread::get_id();
+    return true;
+}
+
+int64_t XLooper::endPoll() {
+    lock_guard<mutex> autoLock(mLock);
+    mPolling = false;
+    mThreadID = thread::id();
+    return nextWhenUs_l();
+}
+
+int64_t XLooper::pollOnce(int64_t timeoutUs) {
+    if (!beginPoll()) {
+        return -1;
     }
 
-    list<Event>::iterator it = mEventQueue.begin();
-    while (it != mEventQueue.end() && (*it).mWhenUs <= whenUs) {
-        ++it;
+    int64_t startUs = nowUs();
+    int64_t waitUntilUs = INT64_MAX;
+    if (timeoutUs >= 0) {
+        waitUntilUs = timeoutUs > INT64_MAX - startUs ? INT64_MAX : startUs + timeoutUs;
+    }
+    // once something ran, stop waiting and only drain what was due when it
+    // started; events posted from handlers meanwhile are left for the next
+    // call so a handler re-posting itself cannot keep the host here
+    int64_t dueByUs = INT64_MAX;
+    for (;;) {
+        int64_t turnUs = nowUs();
+        LoopStep step = loop(dueByUs, waitUntilUs);
+        if (step == kStepDone) {
+            break;
+        }
+        if (step == kStepDispatched && dueByUs == INT64_MAX) {
+            dueByUs = waitUntilUs = turnUs;
+        }
+    }
+    return endPoll();
+}
+
+int64_t XLooper::runUntil(int64_t deadlineUs) {
+    if (!beginPoll()) {
+        return -1;
     }
 
+    while (loop(deadlineUs, deadlineUs) != kStepDone) {
+    }
+    return endPoll();
+}
+
+void XLooper::wake() {
+    lock_guard<mutex> autoLock(mLock);
+    mWakeRequested = true;
+    mQueueChangedCondition.notify_all();
+}
+
+void XLooper::setRecorder(shared_ptr<XLooperRecorder> recorder) {
+    lock_guard<mutex> autoLock(mLock);
+    mRecorder = recorder;
+}
+
+static bool needsBytes(const XLooper::QueueLimits &limits) {
+    return limits.mMaxBytes > 0 || limits.mHighBytes > 0;
+}
+
+void XLooper::setQueueLimits(const QueueLimits &limits) {
+    lock_guard<mutex> autoLock(mLock);
+    mQueueAccount.mLimits = limits;
+    mTrackBytes = mTrackBytes || needsBytes(limits);
+    mQueueSpaceCondition.notify_all();
+}
+
+void XLooper::setQueueLimits(handler_id id, const QueueLimits &limits) {
+    lock_guard<mutex> autoLock(mLock);
+    mHandlerAccounts[id].mLimits = limits;
+    mTrackBytes = mTrackBytes || needsBytes(limits);
+    mQueueSpaceCondition.notify_all();
+}
+
+int XLooper::post(shared_ptr<XMessage> msg, int64_t delayUs) {
     Event event;
-    event.mWhenUs = whenUs;
+    event.mWhenUs = delayUs;
+    event.mPriority = msg->priority();
+    event.mMessage = msg;
+    return enqueue(event, true);
+}
+
+int XLooper::publish(const shared_ptr<XMessage> &msg,
+        const shared_ptr<const vector<handler_id> > &targets, int64_t delayUs) {
+    Event event;
+    event.mWhenUs = delayUs;
+    event.mPriority = msg->priority();
     event.mMessage = msg;
+    event.mFanout = targets;
+    return enqueue(event, true);
+}
+
+XLooper::timeline_id XLooper::createTimeline() {
+    lock_guard<mutex> autoLock(mLock);
+    timeline_id id = ++mNextTimelineID;
+    mTimelines[id];
+    return id;
+}
 
-    if (it == mEventQueue.begin()) {
+void XLooper::destroyTimeline(timeline_id id) {
+    // destroyed once mLock is released
+    list<Event> dropped;
+    WatermarkCalls calls;
+    {
+        lock_guard<mutex> autoLock(mLock);
+        map<timeline_id, Timeline>::iterator it = mTimelines.find(id);
+        if (it == mTimelines.end()) {
+            return;
+        }
+        list<Event> &events = it->second.mEvents;
+        for (list<Event>::iterator event = events.begin(); event != events.end(); ++event) {
+            account_l(*event, false, calls);
+        }
+        dropped.splice(dropped.end(), events);
+        mTimelines.erase(it);
+    }
+
+    for (size_t i = 0; i < calls.size(); ++i) {
+        calls[i].first(calls[i].second);
+    }
+}
+
+int XLooper::setTimelineMapping(timeline_id id, int64_t anchorMediaUs, int64_t anchorRealUs,
+        float rate, int64_t maxMediaUs) {
+    lock_guard<mutex> autoLock(mLock);
+    map<timeline_id, Timeline>::iterator it = mTimelines.find(id);
+    if (it == mTimelines.end()) {
+        return -1;
+    }
+
+    Timeline &timeline = it->second;
+    int64_t oldWhenUs = timelineWhenUs(timeline);
+    timeline.mAnchorMediaUs = anchorMediaUs;
+    timeline.mAnchorRealUs = anchorRealUs;
+    timeline.mRate = rate;
+    timeline.mMaxMediaUs = maxMediaUs;
+    // a later wakeup is simply found early with nothing to do
+    if (timelineWhenUs(timeline) < oldWhenUs) {
         mQueueChangedCondition.notify_all();
     }
+    return 0;
+}
+
+int XLooper::postAtMediaTime(const shared_ptr<XMessage> &msg, timeline_id timeline,
+        int64_t mediaUs) {
+    if (msg == nullptr) {
+        return -1;
+    }
+
+    Event event;
+    event.mWhenUs = mediaUs;
+    event.mPriority = msg->priority();
+    event.mMessage = msg;
+    event.mTimeline = timeline;
+    return enqueue(event);
+}
+
+int XLooper::post(XRunnable fn, int64_t delayUs, Priority priority) {
+    if (!fn) {
+        return -1;
+    }
+
+    Event event;
+    event.mWhenUs = delayUs;
+    event.mPriority = priority;
+    event.mRunnable = std::move(fn);
+    return enqueue(event, true);
+}
+
+int XLooper::postPeriodic(const shared_ptr<XMessage> &msg, int64_t periodUs,
+        int64_t delayUs, PeriodicPolicy policy) {
+    if (msg == nullptr || periodUs <= 0) {
+        return -1;
+    }
 
-    mEventQueue.insert(it, event);
+    Event event;
+    event.mWhenUs = delayUs;
+    event.mPriority = msg->priority();
+    event.mMessage = msg;
+    event.mPeriodUs = periodUs;
+    event.mPeriodicPolicy = policy;
+    return enqueue(event, true);
 }
 
-bool XLooper::loop() {
+int XLooper::cancelPeriodic(const shared_ptr<XMessage> &msg) {
+    // destroyed once mLock is released
+    list<Event> cancelled;
+    WatermarkCalls calls;
+    int err = -1;
+    {
+        lock_guard<mutex> autoLock(mLock);
+        if (msg != nullptr && mCurrentPeriodic == msg.get()) {
+            mCurrentPeriodic = NULL;
+            err = 0;
+        }
+        for (int lane = 0; lane < kPriorityCount && msg != nullptr; ++lane) {
+            list<Event> &queue = mEventQueue[lane];
+            for (list<Event>::iterator it = queue.begin(); it != queue.end(); ++it) {
+                if (it->mPeriodUs > 0 && it->mMessage == msg) {
+                    account_l(*it, false, calls);
+                    cancelled.splice(cancelled.end(), queue, it);
+                    err = 0;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (size_t i = 0; i < calls.size(); ++i) {
+        calls[i].first(calls[i].second);
+    }
+    return err;
+}
+
+int XLooper::postAt(XRunnable fn, int64_t whenUs, Priority priority) {
+    if (!fn) {
+        return -1;
+    }
+
     Event event;
+    event.mWhenUs = whenUs;
+    event.mPriority = priority;
+    event.mRunnable = std::move(fn);
+    return enqueue(event);
+}
+
+int XLooper::enqueue(Event &event, bool relative) {
+    // destroyed and called once mLock is released
+    list<Event> evicted;
+    WatermarkCalls calls;
+    shared_ptr<XLooperRecorder> recorder;
+    int err;
     {
         unique_lock<mutex> autoLock(mLock);
+        if (relative) {
+            // read under mLock so a time source swap can't split the post
+            event.mWhenUs = delayToWhenUs_l(event.mWhenUs);
+        }
+        event.mHandlerID = 0;
+        event.mBytes = 0;
+        event.mDeadlineUs = INT64_MAX;
+        if (event.mPriority < 0 || event.mPriority >= kPriorityCount) {
+            event.mPriority = kPriorityNormal;
+        }
+        if (event.mMessage != nullptr) {
+            if (event.mPeriodUs == 0) {
+                event.mDeadlineUs = event.mMessage->mDeadlineUs;
+            }
+            // a published event only counts against the looper-wide limits
+            if (event.mFanout == nullptr) {
+                handler_id target = event.mMessage->mTarget;
+                if (findHandler_l(target) == NULL) {
+                    XLOGW("failed to post message as target handler is gone.");
+                    return -1;
+                }
+                // only events counted against a handler account carry its id
+                if (!mHandlerAccounts.empty() && mHandlerAccounts.count(target) > 0) {
+                    event.mHandlerID = target;
+                }
+            }
+            if (mTrackBytes) {
+                event.mBytes = event.mMessage->payloadSize();
+            }
+        }
+        map<timeline_id, Timeline>::iterator timeline = mTimelines.end();
+        if (event.mTimeline != 0) {
+            timeline = mTimelines.find(event.mTimeline);
+            if (timeline == mTimelines.end()) {
+                XLOGW("failed to post message as timeline %d is gone.", event.mTimeline);
+                return -1;
+            }
+        }
 
-        if (mEventQueue.empty()) {
-            mQueueChangedCondition.wait(autoLock);
-            return true;
+        err = admit_l(event, autoLock, evicted, calls);
+        // admit_l() may have waited for room and let the timeline go
+        if (err == 0 && event.mTimeline != 0) {
+            timeline = mTimelines.find(event.mTimeline);
+            if (timeline == mTimelines.end()) {
+                err = -1;
+            }
+        }
+        if (err == 0) {
+            if (mRecorder != nullptr && event.mMessage != nullptr
+                    && event.mFanout == nullptr && event.mTimeline == 0) {
+                // appended under mLock so the stream keeps this looper's post
+                // order, written to the file once mLock is released
+                mRecorder->record(this, mName.c_str(), event.mMessage,
+                        nowUs_l(), event.mWhenUs, event.mPeriodUs, event.mPeriodicPolicy);
+                recorder = mRecorder;
+            }
+            account_l(event, true, calls);
+            list<Event> node;
+            node.push_back(std::move(event));
+            if (timeline != mTimelines.end()) {
+                enqueueTimeline_l(timeline->second, node);
+            } else {
+                enqueue_l(node);
+            }
+        }
+    }
+
+    if (recorder != nullptr) {
+        recorder->drain();
+    }
+    for (size_t i = 0; i < calls.size(); ++i) {
+        calls[i].first(calls[i].second);
+    }
+    // kOverflowDropNewest is not an error for the poster
+    return err > 0 ? 0 : err;
+}
+
+static bool hasRoom(const XLooper::QueueLimits &limits,
+        size_t messages, size_t bytes, size_t newBytes) {
+    // a single oversized message is still let into an empty queue
+    return (limits.mMaxMessages == 0 || messages < limits.mMaxMessages)
+        && (limits.mMaxBytes == 0 || messages == 0 || bytes + newBytes <= limits.mMaxBytes);
+}
+
+// Returns 0 when |event| may be queued, 1 when it is to be dropped quietly
+// and -1 when the post fails.
+int XLooper::admit_l(Event &event, unique_lock<mutex> &autoLock,
+        list<Event> &evicted, WatermarkCalls &calls) {
+    int64_t deadlineUs = -1;
+    for (;;) {
+        QueueAccount *full = NULL;
+        handler_id scope = 0;
+        if (!hasRoom(mQueueAccount.mLimits,
+                mQueueAccount.mMessages, mQueueAccount.mBytes, event.mBytes)) {
+            full = &mQueueAccount;
+        } else if (event.mHandlerID != 0) {
+            map<handler_id, QueueAccount>::iterator it = mHandlerAccounts.find(event.mHandlerID);
+            if (it != mHandlerAccounts.end() && !hasRoom(it->second.mLimits,
+                    it->second.mMessages, it->second.mBytes, event.mBytes)) {
+                full = &it->second;
+                scope = event.mHandlerID;
+            }
+        }
+        if (full == NULL) {
+            return 0;
+        }
+
+        switch (full->mLimits.mPolicy) {
+            case kOverflowDropNewest:
+                return 1;
+
+            case kOverflowDropOldest:
+                if (!evictOldest_l(scope, evicted, calls)) {
+                    return -1;
+                }
+                break;
+
+            case kOverflowBlock:
+            {
+                // nothing would make room: the poster is the looper thread,
+                // or no thread is running or polling the looper
+                if (this_thread::get_id() == mThreadID
+                        || (mThreadState == nullptr && !mPolling)) {
+                    return -1;
+                }
+                int64_t nowUs = GetNowUs();
+                if (deadlineUs < 0) {
+                    deadlineUs = nowUs + full->mLimits.mBlockTimeoutUs;
+                }
+                if (nowUs >= deadlineUs) {
+                    return -1;
+                }
+                ++mBlockedPosters;
+                mQueueSpaceCondition.wait_for(
+                        autoLock, chrono::microseconds(deadlineUs - nowUs));
+                --mBlockedPosters;
+                break;
+            }
+
+            default:
+                return -1;
+        }
+    }
+}
+
+// A periodic stream has a single queued tick, evicting it would end the
+// stream without telling anyone, so ticks are never picked.
+bool XLooper::evictOldest_l(handler_id id, list<Event> &evicted, WatermarkCalls &calls) {
+    for (int lane = kPriorityCount - 1; lane >= 0; --lane) {
+        list<Event> &queue = mEventQueue[lane];
+        for (list<Event>::iterator it = queue.begin(); it != queue.end(); ++it) {
+            if (it->mPeriodUs == 0 && (id == 0 || it->mHandlerID == id)) {
+                account_l(*it, false, calls);
+                evicted.splice(evicted.end(), queue, it);
+                return true;
+            }
+        }
+        // timeline messages count against the limits from their post on,
+        // they go after the lane's own queue
+        for (map<timeline_id, Timeline>::iterator timeline = mTimelines.begin();
+                timeline != mTimelines.end(); ++timeline) {
+            list<Event> &events = timeline->second.mEvents;
+            for (list<Event>::iterator it = events.begin(); it != events.end(); ++it) {
+                if (it->mPriority == lane && it->mPeriodUs == 0
+                        && (id == 0 || it->mHandlerID == id)) {
+                    account_l(*it, false, calls);
+                    evicted.splice(evicted.end(), events, it);
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+void XLooper::account_l(const Event &event, bool queued, WatermarkCalls &calls) {
+    QueueAccount *accounts[2] = { &mQueueAccount, NULL };
+    if (event.mHandlerID != 0 && !mHandlerAccounts.empty()) {
+        map<handler_id, QueueAccount>::iterator it = mHandlerAccounts.find(event.mHandlerID);
+        if (it != mHandlerAccounts.end()) {
+            accounts[1] = &it->second;
+        }
+    }
+
+    for (int i = 0; i < 2 && accounts[i] != NULL; ++i) {
+        QueueAccount &account = *accounts[i];
+        if (queued) {
+            account.mMessages++;
+            account.mBytes += event.mBytes;
+        } else {
+            account.mMessages--;
+            account.mBytes -= event.mBytes;
+        }
+        updateWatermark(account, calls);
+    }
+
+    // an event leaving its lane leaves the lane's due index with it, still
+    // in the lane list here so mFirstPending can move past it
+    if (!queued && event.mTimeline == 0) {
+        int lane = event.mPriority;
+        if (event.mDueIndex != SIZE_MAX) {
+            removeDue_l(lane, event.mDueIndex);
+        } else if (mFirstPending[lane] != mEventQueue[lane].end()
+                && &*mFirstPending[lane] == &event) {
+            ++mFirstPending[lane];
+        }
+    }
+
+    if (!queued && mBlockedPosters > 0) {
+        mQueueSpaceCondition.notify_all();
+    }
+}
+
+void XLooper::updateWatermark(QueueAccount &account, WatermarkCalls &calls) {
+    const QueueLimits &limits = account.mLimits;
+    if (!limits.mOnWatermark) {
+        return;
+    }
+
+    if (!account.mAboveHigh) {
+        if ((limits.mHighMessages > 0 && account.mMessages >= limits.mHighMessages)
+                || (limits.mHighBytes > 0 && account.mBytes >= limits.mHighBytes)) {
+            account.mAboveHigh = true;
+            calls.push_back(make_pair(limits.mOnWatermark, true));
+        }
+    } else if ((limits.mHighMessages == 0 || account.mMessages <= limits.mLowMessages)
+            && (limits.mHighBytes == 0 || account.mBytes <= limits.mLowBytes)) {
+        // a low mark only applies along with its high mark
+        account.mAboveHigh = false;
+        calls.push_back(make_pair(limits.mOnWatermark, false));
+    }
+}
+
+void XLooper::enqueue_l(list<Event> &node) {
+    const Event &event = node.front();
+    list<Event> &queue = mEventQueue[event.mPriority];
+
+    // due times mostly arrive in order, search from the back
+    list<Event>::iterator it = queue.end();
+    while (it != queue.begin()) {
+        list<Event>::iterator prev = it;
+        --prev;
+        if ((*prev).mWhenUs <= event.mWhenUs) {
+            break;
+        }
+        it = prev;
+    }
+
+    if (it == queue.begin()) {
+        mQueueChangedCondition.notify_all();
+    }
+
+    int lane = event.mPriority;
+    list<Event>::iterator inserted = node.begin();
+    inserted->mSeq = ++mNextSeq;
+    queue.splice(it, node);
+    if (inserted->mWhenUs <= mPromotedUs[lane]) {
+        pushDue_l(lane, inserted);
+    } else if (mFirstPending[lane] == queue.end()
+            || inserted->mWhenUs < mFirstPending[lane]->mWhenUs) {
+        mFirstPending[lane] = inserted;
+    }
+}
+
+// Queues the periodic event in |node| again for its next tick, unless it
+// was cancelled or its handler went away while it was being delivered.
+void XLooper::rearm_l(list<Event> &node, WatermarkCalls &calls) {
+    Event &event = node.front();
+    bool cancelled = mCurrentPeriodic != event.mMessage.get();
+    mCurrentPeriodic = NULL;
+    if (cancelled || findHandler_l(event.mMessage->mTarget) == NULL) {
+        return;
+    }
+
+    // from the due time, not the delivery time, so the period doesn't drift
+    int64_t nowUs = nowUs_l();
+    if (event.mWhenUs > INT64_MAX - event.mPeriodUs) {
+        return;
+    }
+    event.mWhenUs += event.mPeriodUs;
+    if (event.mWhenUs <= nowUs && event.mPeriodicPolicy == kPeriodicSkip) {
+        int64_t missed = (nowUs - event.mWhenUs) / event.mPeriodUs + 1;
+        event.mWhenUs += missed * event.mPeriodUs;
+    }
+
+    account_l(event, true, calls);
+    enqueue_l(node);
+}
+
+list<XLooper::Event> *XLooper::nextDueLane_l(int64_t nowUs) {
+    int lane = -1;
+    int starved = -1;
+    for (int i = 0; i < kPriorityCount; ++i) {
+        if (mEventQueue[i].empty() || mEventQueue[i].front().mWhenUs > nowUs) {
+            continue;
+        }
+        if (lane < 0) {
+            lane = i;
+        } else if (starved < 0 && mLaneBypassCount[i] >= kMaxLaneBypass) {
+            starved = i;
+        }
+    }
+    if (lane < 0) {
+        return NULL;
+    }
+    if (starved >= 0) {
+        lane = starved;
+    }
+
+    for (int i = 0; i < kPriorityCount; ++i) {
+        if (i == lane) {
+            mLaneBypassCount[i] = 0;
+        } else if (!mEventQueue[i].empty() && mEventQueue[i].front().mWhenUs <= nowUs) {
+            ++mLaneBypassCount[i];
+        }
+    }
+    return &mEventQueue[lane];
+}
+
+// An event without a deadline is due by its own due time, so it is only
+// bypassed by deadlines earlier than that and can't starve. Ties keep the
+// order the events were queued in.
+static inline int64_t effectiveDeadlineUs(const XLooper::Event &event) {
+    return event.mDeadlineUs != INT64_MAX ? event.mDeadlineUs : event.mWhenUs;
+}
+
+static inline bool isDueBefore(const XLooper::Event &a, const XLooper::Event &b) {
+    int64_t aUs = effectiveDeadlineUs(a);
+    int64_t bUs = effectiveDeadlineUs(b);
+    return aUs < bUs || (aUs == bUs && a.mSeq < b.mSeq);
+}
+
+void XLooper::pushDue_l(int lane, list<Event>::iterator it) {
+    vector<list<Event>::iterator> &heap = mDueHeap[lane];
+    it->mDueIndex = heap.size();
+    heap.push_back(it);
+    siftDue_l(lane, it->mDueIndex);
+}
+
+void XLooper::removeDue_l(int lane, size_t index) {
+    vector<list<Event>::iterator> &heap = mDueHeap[lane];
+    heap[index]->mDueIndex = SIZE_MAX;
+    if (index + 1 < heap.size()) {
+        heap[index] = heap.back();
+        heap[index]->mDueIndex = index;
+        heap.pop_back();
+        siftDue_l(lane, index);
+    } else {
+        heap.pop_back();
+    }
+}
+
+// Moves the entry at |index| up or down to its place in the heap.
+void XLooper::siftDue_l(int lane, size_t index) {
+    vector<list<Event>::iterator> &heap = mDueHeap[lane];
+    list<Event>::iterator it = heap[index];
+    while (index > 0) {
+        size_t parent = (index - 1) / 2;
+        if (!isDueBefore(*it, *heap[parent])) {
+            break;
+        }
+        heap[index] = heap[parent];
+        heap[index]->mDueIndex = index;
+        index = parent;
+    }
+    for (;;) {
+        size_t child = 2 * index + 1;
+        if (child >= heap.size()) {
+            break;
+        }
+        if (child + 1 < heap.size() && isDueBefore(*heap[child + 1], *heap[child])) {
+            ++child;
+        }
+        if (!isDueBefore(*heap[child], *it)) {
+            break;
+        }
+        heap[index] = heap[child];
+        heap[index]->mDueIndex = index;
+        index = child;
+    }
+    heap[index] = it;
+    it->mDueIndex = index;
+}
+
+// Earliest deadline among the events of |lane| due by |nowUs|, see
+// effectiveDeadlineUs(). Events becoming due move from the lane's pending
+// tail into the due heap, O(log n) each.
+list<XLooper::Event>::iterator XLooper::earliestDeadline_l(int lane, int64_t nowUs) {
+    list<Event> &queue = mEventQueue[lane];
+    if (nowUs < mPromotedUs[lane]) {
+        // the time source went back, rebuild from the lane list
+        for (size_t i = 0; i < mDueHeap[lane].size(); ++i) {
+            mDueHeap[lane][i]->mDueIndex = SIZE_MAX;
         }
-        int64_t whenUs = (*mEventQueue.begin()).mWhenUs;
-        int64_t nowUs = GetNowUs();
+        mDueHeap[lane].clear();
+        mFirstPending[lane] = queue.begin();
+    }
+    while (mFirstPending[lane] != queue.end() && mFirstPending[lane]->mWhenUs <= nowUs) {
+        pushDue_l(lane, mFirstPending[lane]);
+        ++mFirstPending[lane];
+    }
+    mPromotedUs[lane] = nowUs;
+    return mDueHeap[lane].front();
+}
+
+void XLooper::getDeadlineStats(DeadlineStats *stats) {
+    lock_guard<mutex> autoLock(mLock);
+    if (stats != NULL) {
+        *stats = mDeadlineStats;
+    }
+}
+
+int64_t XLooper::nextWhenUs_l() const {
+    int64_t whenUs = INT64_MAX;
+    for (int i = 0; i < kPriorityCount; ++i) {
+        if (!mEventQueue[i].empty() && mEventQueue[i].front().mWhenUs < whenUs) {
+            whenUs = mEventQueue[i].front().mWhenUs;
+        }
+    }
+    for (map<timeline_id, Timeline>::const_iterator it = mTimelines.begin();
+            it != mTimelines.end(); ++it) {
+        int64_t timelineUs = timelineWhenUs(it->second);
+        if (timelineUs < whenUs) {
+            whenUs = timelineUs;
+        }
+    }
+    return whenUs;
+}
+
+// Looper time at which the earliest message of |timeline| is due,
+// INT64_MAX while the timeline is paused or held short of it.
+int64_t XLooper::timelineWhenUs(const Timeline &timeline) {
+    if (timeline.mEvents.empty() || timeline.mAnchorRealUs < 0 || timeline.mRate <= 0) {
+        return INT64_MAX;
+    }
+    int64_t mediaUs = timeline.mEvents.front().mWhenUs;
+    if (mediaUs > timeline.mMaxMediaUs) {
+        return INT64_MAX;
+    }
+    double whenUs = timeline.mAnchorRealUs
+            + (mediaUs - timeline.mAnchorMediaUs) / (double)timeline.mRate;
+    if (whenUs >= (double)INT64_MAX) {
+        return INT64_MAX;
+    }
+    if (whenUs <= (double)INT64_MIN) {
+        return INT64_MIN;
+    }
+    return (int64_t)whenUs;
+}
+
+void XLooper::enqueueTimeline_l(Timeline &timeline, list<Event> &node) {
+    const Event &event = node.front();
+    list<Event> &events = timeline.mEvents;
+
+    list<Event>::iterator it = events.end();
+    while (it != events.begin()) {
+        list<Event>::iterator prev = it;
+        --prev;
+        if ((*prev).mWhenUs <= event.mWhenUs) {
+            break;
+        }
+        it = prev;
+    }
+
+    if (it == events.begin()) {
+        mQueueChangedCondition.notify_all();
+    }
 
-        if (whenUs > nowUs) {
-            int64_t delayUs = whenUs - nowUs;
-            if (delayUs > INT64_MAX / 1000) {
-                delayUs = INT64_MAX / 1000;
+    events.splice(it, node);
+}
+
+// Moves the timeline messages due by |dueByUs| to their lanes, at the
+// looper time they became due.
+void XLooper::promoteTimelines_l(int64_t dueByUs) {
+    for (map<timeline_id, Timeline>::iterator it = mTimelines.begin();
+            it != mTimelines.end(); ++it) {
+        Timeline &timeline = it->second;
+        for (;;) {
+            int64_t whenUs = timelineWhenUs(timeline);
+            if (whenUs > dueByUs) {
+                break;
             }
-            mQueueChangedCondition.wait_for(autoLock, chrono::milliseconds(delayUs /1000ll));
+            list<Event> node;
+            node.splice(node.begin(), timeline.mEvents, timeline.mEvents.begin());
+            node.front().mWhenUs = whenUs;
+            node.front().mTimeline = 0;
+            enqueue_l(node);
+        }
+    }
+}
 
+int32_t XLooper::addIdleHandler(IdleHandler handler) {
+    lock_guard<mutex> autoLock(mLock);
+    shared_ptr<IdleEntry> entry = make_shared<IdleEntry>();
+    entry->mID = ++mNextIdleHandlerID;
+    entry->mHandler = handler;
+    mIdleHandlers.push_back(entry);
+    mIdlePending = true;
+    mQueueChangedCondition.notify_all();
+    return entry->mID;
+}
+
+void XLooper::removeIdleHandler(int32_t id) {
+    lock_guard<mutex> autoLock(mLock);
+    removeIdleHandler_l(id);
+}
+
+void XLooper::waitUntil_l(unique_lock<mutex> &autoLock, int64_t whenUs) {
+    if (mTimeSource != nullptr) {
+        // setTimeSource() may replace it while we wait
+        shared_ptr<XTimeSource> timeSource = mTimeSource;
+        timeSource->waitUntil(autoLock, mQueueChangedCondition, whenUs);
+        return;
+    }
+
+    if (whenUs == INT64_MAX) {
+        mQueueChangedCondition.wait(autoLock);
+        return;
+    }
+    mQueueChangedCondition.wait_for(autoLock, chrono::microseconds(whenUs - GetNowUs()));
+}
+
+void XLooper::removeIdleHandler_l(int32_t id) {
+    for (size_t i = 0; i < mIdleHandlers.size(); ++i) {
+        if (mIdleHandlers[i]->mID == id) {
+            mIdleHandlers.erase(mIdleHandlers.begin() + i);
+            return;
+        }
+    }
+}
+
+bool XLooper::hasIdleHandler_l(int32_t id) const {
+    for (size_t i = 0; i < mIdleHandlers.size(); ++i) {
+        if (mIdleHandlers[i]->mID == id) {
             return true;
         }
+    }
+    return false;
+}
 
-        event = *mEventQueue.begin();
-        mEventQueue.erase(mEventQueue.begin());
+void XLooper::runIdleHandlers_l(unique_lock<mutex> &autoLock) {
+    // handlers may add or remove idle handlers while mLock is released
+    vector<shared_ptr<IdleEntry> > handlers = mIdleHandlers;
+    // ids grow in the order handlers are added, resume at the first one
+    // the interrupted pass didn't run
+    size_t start = 0;
+    while (start < handlers.size() && handlers[start]->mID < mIdleResumeID) {
+        ++start;
+    }
+    if (start == handlers.size()) {
+        start = 0;
     }
 
-    event.mMessage->deliver();
+    for (size_t n = 0; n < handlers.size(); ++n) {
+        const shared_ptr<IdleEntry> &entry = handlers[(start + n) % handlers.size()];
+        if (!hasIdleHandler_l(entry->mID)) {
+            // removed while mLock was released
+            continue;
+        }
+
+        int64_t budgetUs = nextWhenUs_l();
+        if (budgetUs != INT64_MAX) {
+            budgetUs -= nowUs_l();
+        }
+        if (budgetUs <= 0 || (mThreadState == nullptr && !mPolling)) {
+            // work came in, the rest waits for the next idle period
+            mIdleResumeID = entry->mID;
+            mIdlePending = true;
+            return;
+        }
+
+        bool keep;
+        autoLock.unlock();
+        keep = entry->mHandler(budgetUs);
+        autoLock.lock();
+
+        if (!keep) {
+            removeIdleHandler_l(entry->mID);
+        }
+    }
+    mIdleResumeID = 0;
+}
+
+void XLooper::deliverFanout(const Event &event) {
+    // the message may belong to another looper, hold this one ourselves
+    shared_ptr<XLooper> self = mLooper.lock();
+    shared_ptr<XMessage> msg = event.mMessage;
+    const vector<handler_id> &targets = *event.mFanout;
+    for (size_t i = 0; i < targets.size(); ++i) {
+        XHandler *handler;
+        {
+            lock_guard<mutex> autoLock(mLock);
+            // handlers unregistered since the publish are skipped quietly
+            handler = findHandler_l(targets[i]);
+            if (handler == NULL) {
+                continue;
+            }
+            mDeliveringID.store(targets[i]);
+        }
+
+        msg->dispatch(handler, msg);
+        mDeliveringID.store(0);
+        if (mUnregisterWaiters.load() > 0) {
+            lock_guard<mutex> autoLock(mLock);
+            mDeliveryDoneCondition.notify_all();
+        }
+    }
+}
+
+XLooper::LoopStep XLooper::loop(int64_t dueByUs, int64_t waitUntilUs) {
+    // the event keeps its list node so a periodic message is re-armed
+    // without allocating
+    list<Event> current;
+    WatermarkCalls calls;
+    XHandler *handler = NULL;
+    bool expired = false;
+    int64_t lateUs = 0;
+    {
+        unique_lock<mutex> autoLock(mLock);
+        if (mThreadState == nullptr && !mPolling) {
+            // stop() is pending
+            return kStepDone;
+        }
+
+        int64_t whenUs = nextWhenUs_l();
+        int64_t nowUs = nowUs_l();
+        if (whenUs > nowUs && mIdlePending) {
+            mIdlePending = false;
+            runIdleHandlers_l(autoLock);
+            return kStepIdle;
+        }
+
+        int64_t limitUs = nowUs < dueByUs ? nowUs : dueByUs;
+        if (whenUs > limitUs) {
+            if (mWakeRequested) {
+                mWakeRequested = false;
+                return kStepDone;
+            }
+            int64_t untilUs = whenUs < waitUntilUs ? whenUs : waitUntilUs;
+            if (untilUs <= nowUs) {
+                return kStepDone;
+            }
+            waitUntil_l(autoLock, untilUs);
+            return kStepWaited;
+        }
+
+        promoteTimelines_l(limitUs);
+        list<Event> *queue = nextDueLane_l(limitUs);
+        list<Event>::iterator it = earliestDeadline_l(queue - mEventQueue, limitUs);
+        current.splice(current.begin(), *queue, it);
+        Event &event = current.front();
+        account_l(event, false, calls);
+        mIdlePending = !mIdleHandlers.empty();
+
+        if (event.mDeadlineUs != INT64_MAX) {
+            mDeadlineStats.mMessages++;
+            lateUs = nowUs > event.mDeadlineUs ? nowUs - event.mDeadlineUs : 0;
+            if (event.mFanout == nullptr) {
+                event.mMessage->mLateUs = lateUs;
+            }
+            if (lateUs > 0) {
+                mDeadlineStats.mMissed++;
+                if (lateUs > mDeadlineStats.mMaxLateUs) {
+                    mDeadlineStats.mMaxLateUs = lateUs;
+                }
+                if (event.mMessage->mDeadlinePolicy == kDeadlineDrop) {
+                    mDeadlineStats.mDropped++;
+                    expired = true;
+                }
+            }
+        }
+
+        if (event.mMessage != nullptr && event.mFanout == nullptr && !expired) {
+            handler = findHandler_l(event.mMessage->mTarget);
+            if (handler != NULL) {
+                mDeliveringID.store(event.mMessage->mTarget);
+                if (event.mPeriodUs > 0) {
+                    mCurrentPeriodic = event.mMessage.get();
+                }
+            }
+        }
+    }
+    Event &event = current.front();
+
+    for (size_t i = 0; i < calls.size(); ++i) {
+        calls[i].first(calls[i].second);
+    }
+
+    if (expired) {
+        XLOGV("dropped message %u, %lld us past its deadline",
+                event.mMessage->what(), (long long)lateUs);
+        return kStepDispatched;
+    }
+
+    if (event.mFanout != nullptr) {
+        deliverFanout(event);
+        return kStepDispatched;
+    }
+
+    if (event.mMessage != nullptr) {
+        if (handler == NULL) {
+            XLOGW("failed to deliver message as target handler is gone.");
+            return kStepDispatched;
+        }
+
+        // |msg| keeps the message, and with it this looper, alive until we
+        // are done with our members, also once a re-armed tick has left
+        // |current|
+        shared_ptr<XMessage> msg = event.mMessage;
+        msg->dispatch(handler, msg);
+        if (event.mPeriodUs > 0) {
+            // before mDeliveringID is cleared, so unregisterHandler() either
+            // purges the re-armed tick or makes rearm_l() drop it
+            calls.clear();
+            {
+                lock_guard<mutex> autoLock(mLock);
+                rearm_l(current, calls);
+            }
+            for (size_t i = 0; i < calls.size(); ++i) {
+                calls[i].first(calls[i].second);
+            }
+        }
+        mDeliveringID.store(0);
+        if (mUnregisterWaiters.load() > 0) {
+            lock_guard<mutex> autoLock(mLock);
+            mDeliveryDoneCondition.notify_all();
+        }
+    } else {
+        event.mRunnable();
+    }
 
     // NOTE: It's important to note that at this point our "ALooper" object
     // may no longer exist (its final reference may have gone away while
     // delivering the message). We have made sure, however, that loop()
     // won't be called again.
 
-    return true;
+    return kStepDispatched;
 }
@@ -9,15 +9,21 @@
 #define XLooper_hpp
 
 #include <stdio.h>
+#include <atomic>
 #include <list>
+#include <map>
+#include <vector>
+#include <functional>
 #include <mutex>
 #include <condition_variable>
 #include <thread>
 
-#include "XMessage.h"
+#include "XRunnable.h"
+#include "XTimeSource.h"
 
 class XHandler;
 class XMessage;
+class XLooperRecorder;
 
 using namespace std;
 
@@ -28,43 +34,403 @@ private:
 public:
     typedef int32_t event_id;
     typedef int32_t handler_id;
+    typedef int32_t timeline_id;
     static shared_ptr<XLooper> createLooper();
 
     virtual ~XLooper();
 
     static int64_t GetNowUs();
+
+    // Among events that are already due, urgent lanes are dispatched first
+    // and each lane is FIFO, so a seek or flush doesn't wait behind a backlog
+    // of due data messages. A due lane that keeps being passed over is served
+    // after kMaxLaneBypass dispatches from higher lanes, so bulk traffic
+    // can't starve.
+    enum Priority {
+        kPriorityUrgent = 0,    // pause, seek, flush...
+        kPriorityNormal,
+        kPriorityBulk,
+        kPriorityCount,
+    };
+
+    enum {
+        kMaxLaneBypass = 16,
+    };
+
+    // What happens to a message found past its deadline, see
+    // XMessage::setDeadline().
+    enum DeadlinePolicy {
+        kDeadlineDeliver,   // deliver anyway, XMessage::lateUs() tells by how much
+        kDeadlineDrop,      // discard it undelivered
+    };
+
+    // Counts over messages that carried a deadline, since the looper was
+    // created.
+    struct DeadlineStats {
+        DeadlineStats();
+        uint64_t mMessages;
+        // past their deadline when their turn came, delivered or not
+        uint64_t mMissed;
+        // missed and discarded per kDeadlineDrop
+        uint64_t mDropped;
+        int64_t mMaxLateUs;
+    };
+
+    // What a periodic message does when it falls behind by whole periods.
+    enum PeriodicPolicy {
+        kPeriodicSkip,      // drop the missed ticks, stay on the period grid
+        kPeriodicCatchUp,   // deliver the missed ticks back to back
+    };
+
+    // What post() does when a bounded queue is full.
+    enum OverflowPolicy {
+        // wait up to mBlockTimeoutUs for room, then fail like kOverflowReject.
+        // Posts from the looper's own thread, or while neither started nor
+        // polled (see beginPoll()), fail at once instead.
+        kOverflowBlock,
+        // post() returns -1
+        kOverflowReject,
+        // evict the oldest queued event, least urgent lane first, messages
+        // still waiting on a timeline after the lane's own queue; periodic
+        // ticks are never evicted
+        kOverflowDropOldest,
+        // silently discard the event being posted, post() returns 0
+        kOverflowDropNewest,
+    };
+
+    // Optional capacity of a looper queue, or of one handler's share of it.
+    // Zero means unbounded. Bytes are payload bytes, see
+    // XMessage::payloadSize(); callables count as messages only.
+    //
+    // |mOnWatermark(true)| is called once the queue reaches either high mark
+    // and |mOnWatermark(false)| once it drains back to the low mark of
+    // every high mark set (a low mark without its high mark is ignored), so
+    // producers can throttle before posts start failing. It runs on the
+    // posting or the looper thread, outside the looper lock.
+    struct QueueLimits {
+        QueueLimits();
+
+        size_t mMaxMessages;
+        size_t mMaxBytes;
+        OverflowPolicy mPolicy;
+        int64_t mBlockTimeoutUs;
+
+        size_t mHighMessages;
+        size_t mLowMessages;
+        size_t mHighBytes;
+        size_t mLowBytes;
+        function<void(bool aboveHigh)> mOnWatermark;
+    };
+    
+    enum SchedPolicy {
+        kSchedDefault,      // SCHED_OTHER, mPriority is a nice value
+        kSchedFifo,         // SCHED_FIFO, mPriority is the RT priority
+        kSchedRoundRobin,   // SCHED_RR, mPriority is the RT priority
+    };
+
+    // Placement of the looper thread, applied by the thread itself when
+    // start() runs. The thread is also named after setName() so loopers can
+    // be told apart in perf and top. Settings the OS refuses (RT scheduling
+    // without privileges, CPUs outside the cpuset...) are left at their
+    // defaults; getThreadConfig() reports what is actually in effect.
+    struct ThreadConfig {
+        ThreadConfig();
+
+        // CPUs the thread may run on, empty for no restriction
+        vector<int> mCpus;
+        SchedPolicy mPolicy;
+        int mPriority;
+        // preferred NUMA node for memory the looper thread allocates, -1 for
+        // the system default
+        int mNumaNode;
+    };
     
     struct Event {
+        Event();
         int64_t mWhenUs;
+        // copied from the message, INT64_MAX for none
+        int64_t mDeadlineUs;
+        int32_t mPriority;
+        // only filled in when queue limits need them
+        handler_id mHandlerID;
+        size_t mBytes;
         shared_ptr<XMessage> mMessage;
+        // set instead of mMessage for post(XRunnable)
+        XRunnable mRunnable;
+        // set with mMessage for XTopic::publish(), the subscribers on this
+        // looper; mMessage is shared with other loopers and left untouched
+        shared_ptr<const vector<handler_id> > mFanout;
+        // > 0 for postPeriodic()
+        int64_t mPeriodUs;
+        int32_t mPeriodicPolicy;
+        // set for postAtMediaTime(), mWhenUs is in media time until the
+        // event leaves the timeline for its lane
+        timeline_id mTimeline;
+        // lane insertion order, breaks ties between equal deadlines
+        uint64_t mSeq;
+        // position in the lane's due heap, SIZE_MAX until the event is due
+        size_t mDueIndex;
     };
 
+    // Handlers are kept in a per-looper table and messages address them by
+    // id, a slot index tagged with the slot's generation, so an id outlives
+    // neither its handler nor its registration. unregisterHandler() drops the
+    // messages still queued for the handler and waits for a delivery to it
+    // in progress on the looper thread, after it returns the handler is
+    // never called again. A handler belongs to one looper at a time,
+    // registering it with another looper unregisters it from the previous
+    // one first.
     handler_id registerHandler(XHandler *handler);
     void unregisterHandler(XHandler *handler);
 
     int start();
     int stop();
+
+    // Embedded use, without start(): the looper runs on the caller's thread
+    // for the duration of the call, so a host with its own main loop can
+    // merge looper work into it with no thread hop. Both return the due
+    // time of the next queued event (INT64_MAX if there is none), in
+    // nowUs() time, for the host to schedule its next call; -1 if the
+    // looper has a thread of its own or is already being polled.
+    //
+    // pollOnce() waits up to |timeoutUs| (0 to not wait, -1 for no limit)
+    // for work, then dispatches what is due at that point and runs idle
+    // handlers once nothing is. runUntil() keeps dispatching events due by
+    // the absolute time |deadlineUs| and returns once that time is reached.
+    // wake() makes either return early, from any thread.
+    int64_t pollOnce(int64_t timeoutUs);
+    int64_t runUntil(int64_t deadlineUs);
+    void wake();
     
     void setName(const char *name);
 
+    // Takes effect on the next start().
+    void setThreadConfig(const ThreadConfig &config);
+    // Settings in effect on the running looper thread, -1 if not started.
+    int getThreadConfig(ThreadConfig *config);
+
+    // Runs |fn| on the looper thread once |delayUs| has elapsed, no handler
+    // or message needed. Callables share the queue with messages and are
+    // ordered with them by due time. -1 if |fn| is empty.
+    int post(XRunnable fn, int64_t delayUs = 0, Priority priority = kPriorityNormal);
+    // Same as post() but at the absolute time |whenUs| (see nowUs()).
+    int postAt(XRunnable fn, int64_t whenUs, Priority priority = kPriorityNormal);
+
+    // Delivers |msg| every |periodUs|, the first time after |delayUs|. Each
+    // tick is scheduled from the previous tick's due time rather than its
+    // delivery, so handler run time and wakeup latency don't accumulate, and
+    // the same message object is delivered every time. Deadlines don't apply
+    // to periodic messages. Re-arming bypasses queue limits.
+    int postPeriodic(const shared_ptr<XMessage> &msg, int64_t periodUs,
+            int64_t delayUs = 0, PeriodicPolicy policy = kPeriodicSkip);
+    // Stops the ticks of |msg|. Safe from its own handler; a tick being
+    // delivered is not re-armed. -1 if |msg| isn't periodic on this looper.
+    int cancelPeriodic(const shared_ptr<XMessage> &msg);
+
+    // A timeline is a media time axis mapped onto the looper's time:
+    //     media time = anchorMediaUs + (nowUs() - anchorRealUs) * rate
+    // held still at |maxMediaUs|. Messages queued on it with
+    // postAtMediaTime() are kept in media time order and move to their
+    // lane once the mapping says they are due, so re-anchoring, pausing
+    // (rate 0 or anchorRealUs -1) or a rate change is one mapping update
+    // and a wakeup check for the timeline's earliest message, whatever the
+    // number of messages queued. A new timeline is not anchored.
+    timeline_id createTimeline();
+    // Drops the messages still queued on the timeline.
+    void destroyTimeline(timeline_id id);
+    int setTimelineMapping(timeline_id id, int64_t anchorMediaUs, int64_t anchorRealUs,
+            float rate, int64_t maxMediaUs = INT64_MAX);
+    // -1 if there is no such timeline. Not recorded by XLooperRecorder.
+    int postAtMediaTime(const shared_ptr<XMessage> &msg, timeline_id timeline,
+            int64_t mediaUs);
+
+    // Bounds the whole queue.
+    void setQueueLimits(const QueueLimits &limits);
+    // Bounds the messages queued for handler |id|, on top of the looper's
+    // own limits.
+    void setQueueLimits(handler_id id, const QueueLimits &limits);
+
+    // Deferrable work run on the looper thread when nothing is due: trimming
+    // pools, precomputing, flushing stats. Idle handlers run once each time
+    // the looper goes idle, in the order they were added. |budgetUs| is the
+    // time left until the next queued event (INT64_MAX if there is none);
+    // a handler should return well within it. Return true to be kept for
+    // the next idle period, false to be removed. Handlers not reached before
+    // new work becomes due are the first to run in the next idle period, so
+    // a busy looper still gets through all of them in turn. A handler
+    // removed while another one runs is not called again.
+    typedef function<bool(int64_t budgetUs)> IdleHandler;
+    int32_t addIdleHandler(IdleHandler handler);
+    void removeIdleHandler(int32_t id);
+
+    // Schedules against |timeSource| instead of GetNowUs(), nullptr goes
+    // back to it. Due times already queued are kept as they are, so switch
+    // before posting. See XVirtualTimeSource.
+    void setTimeSource(shared_ptr<XTimeSource> timeSource);
+    // Current time of the looper's time source.
+    int64_t nowUs();
+
+    void getDeadlineStats(DeadlineStats *stats);
+
+    // Streams every message posted from now on to |recorder|, nullptr stops
+    // recording. See XLooperRecorder.
+    void setRecorder(shared_ptr<XLooperRecorder> recorder);
+
 private:
     friend class XMessage;
     friend class XHandler;
-    void post(shared_ptr<XMessage> msg, int64_t delayUs);
-    bool loop();
-    void thread_func();
+    friend class XTopic;       // publish()
+    struct QueueAccount {
+        QueueAccount();
+        QueueLimits mLimits;
+        size_t mMessages;
+        size_t mBytes;
+        bool mAboveHigh;
+    };
+    typedef vector<pair<function<void(bool)>, bool> > WatermarkCalls;
+
+    enum {
+        kHandlerSlotBits = 16,
+        kHandlerGenerationMask = 0x7fff,
+    };
+
+    struct HandlerSlot {
+        XHandler *mHandler;
+        uint32_t mGeneration;
+    };
+
+    // Shared with the looper thread, which may outlive the looper when the
+    // looper's last reference is dropped on it.
+    struct ThreadState {
+        ThreadState();
+        atomic<bool> mExitPending;
+        mutex mLock;
+        // signalled once the thread is configured and when it exits
+        condition_variable mCondition;
+        bool mRunning;
+        bool mConfigured;
+        ThreadConfig mConfig;
+    };
+
+    struct IdleEntry {
+        int32_t mID;
+        IdleHandler mHandler;
+    };
+
+    struct Timeline {
+        Timeline();
+        int64_t mAnchorMediaUs;
+        // -1 while not anchored
+        int64_t mAnchorRealUs;
+        float mRate;
+        int64_t mMaxMediaUs;
+        // by media time
+        list<Event> mEvents;
+    };
+
+    static handler_id makeHandlerID(uint32_t slot, uint32_t generation);
+    XHandler *findHandler_l(handler_id id) const;
+    void purgeHandler_l(list<Event> &queue, handler_id id, list<Event> &purged,
+            WatermarkCalls &calls);
+
+    int post(shared_ptr<XMessage> msg, int64_t delayUs);
+    // one event delivering |msg| to each of |targets| in turn
+    int publish(const shared_ptr<XMessage> &msg,
+            const shared_ptr<const vector<handler_id> > &targets, int64_t delayUs);
+    void deliverFanout(const Event &event);
+    int64_t nowUs_l();
+    int64_t delayToWhenUs_l(int64_t delayUs);
+    // |relative| events carry a delay in mWhenUs, resolved under mLock
+    int enqueue(Event &event, bool relative = false);
+    int admit_l(Event &event, unique_lock<mutex> &autoLock, list<Event> &evicted,
+            WatermarkCalls &calls);
+    bool evictOldest_l(handler_id id, list<Event> &evicted, WatermarkCalls &calls);
+    void account_l(const Event &event, bool queued, WatermarkCalls &calls);
+    static void updateWatermark(QueueAccount &account, WatermarkCalls &calls);
+    // |node| holds the one event to queue, its list node is reused
+    void enqueue_l(list<Event> &node);
+    void enqueueTimeline_l(Timeline &timeline, list<Event> &node);
+    void rearm_l(list<Event> &node, WatermarkCalls &calls);
+    list<Event> *nextDueLane_l(int64_t nowUs);
+    list<Event>::iterator earliestDeadline_l(int lane, int64_t nowUs);
+    void pushDue_l(int lane, list<Event>::iterator it);
+    void removeDue_l(int lane, size_t index);
+    void siftDue_l(int lane, size_t index);
+    int64_t nextWhenUs_l() const;
+    static int64_t timelineWhenUs(const Timeline &timeline);
+    void promoteTimelines_l(int64_t dueByUs);
+    void waitUntil_l(unique_lock<mutex> &autoLock, int64_t whenUs);
+    void removeIdleHandler_l(int32_t id);
+    bool hasIdleHandler_l(int32_t id) const;
+    void runIdleHandlers_l(unique_lock<mutex> &autoLock);
+
+    enum LoopStep {
+        kStepDispatched,
+        kStepIdle,
+        kStepWaited,
+        // nothing due and no time left to wait, or stop()/wake()
+        kStepDone,
+    };
+    // One turn of the loop: dispatches the next event due by |dueByUs|, or
+    // runs idle handlers, or waits for work until |waitUntilUs| at most.
+    LoopStep loop(int64_t dueByUs, int64_t waitUntilUs);
+    bool beginPoll();
+    int64_t endPoll();
+    void thread_func(shared_ptr<ThreadState> state, string name, ThreadConfig config);
     
     weak_ptr<XLooper> mLooper;
     mutex mLock;
-    mutex mExitLock;
-    list<Event> mEventQueue;
+    // one due-time ordered queue per Priority lane
+    list<Event> mEventQueue[kPriorityCount];
+    uint32_t mLaneBypassCount[kPriorityCount];
+    // Due events of each lane, a binary heap on their deadline, plain events
+    // counting as due by their own mWhenUs. The events due by
+    // mPromotedUs[lane] are in the heap, the others start at
+    // mFirstPending[lane], the lane list stays ordered by due time.
+    vector<list<Event>::iterator> mDueHeap[kPriorityCount];
+    list<Event>::iterator mFirstPending[kPriorityCount];
+    int64_t mPromotedUs[kPriorityCount];
+    uint64_t mNextSeq;
+    DeadlineStats mDeadlineStats;
+    // periodic message being delivered, reset by cancelPeriodic()
+    XMessage *mCurrentPeriodic;
+    shared_ptr<XLooperRecorder> mRecorder;
+    shared_ptr<XTimeSource> mTimeSource;
+
+    vector<HandlerSlot> mHandlers;
+    vector<uint32_t> mFreeHandlerSlots;
+    // handler being called on the looper thread, 0 if none
+    atomic<handler_id> mDeliveringID;
+    atomic<uint32_t> mUnregisterWaiters;
+    condition_variable mDeliveryDoneCondition;
+
+    vector<shared_ptr<IdleEntry> > mIdleHandlers;
+    int32_t mNextIdleHandlerID;
+    // id of the idle handler an interrupted pass resumes at, 0 to start over
+    int32_t mIdleResumeID;
+    // set after each dispatch, idle handlers run once per idle period
+    bool mIdlePending;
+    map<timeline_id, Timeline> mTimelines;
+    timeline_id mNextTimelineID;
+    // pollOnce()/runUntil() in progress, the caller is the looper thread
+    bool mPolling;
+    bool mWakeRequested;
+
+    QueueAccount mQueueAccount;
+    map<handler_id, QueueAccount> mHandlerAccounts;
+    bool mTrackBytes;
+    uint32_t mBlockedPosters;
+    condition_variable mQueueSpaceCondition;
+    thread::id mThreadID;
 
     condition_variable mQueueChangedCondition;
-    condition_variable mThreadExitedCondition;
     thread mThread;
-    bool mThreadRun;
-    bool mExitPending;
+    shared_ptr<ThreadState> mThreadState;
+    ThreadConfig mThreadConfig;
     string mName;
 };
 
+// after the class, XMessage uses XLooper's types whichever header comes first
+#include "XMessage.h"
+
 #endif /* XLooper_hpp */
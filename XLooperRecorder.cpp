@@ -0,0 +1,237 @@
+//
+//  XLooperRecorder.cpp
+//  foundation
+//
+
+#define LOG_TAG "XLooperRecorder"
+#include <string.h>
+#include <algorithm>
+#include "XLooperRecorder.h"
+#include "XLog.h"
+
+shared_ptr<XLooperRecorder> XLooperRecorder::create(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        XLOGE("failed to open %s", path);
+        return nullptr;
+    }
+
+    uint32_t header[2] = { kMagic, kVersion };
+    fwrite(header, sizeof(header), 1, file);
+    return shared_ptr<XLooperRecorder>(new XLooperRecorder(file));
+}
+
+XLooperRecorder::XLooperRecorder(FILE *file)
+    : mFile(file) {
+}
+
+XLooperRecorder::~XLooperRecorder() {
+    drain();
+    fclose(mFile);
+}
+
+void XLooperRecorder::flush() {
+    drain();
+    lock_guard<mutex> autoLock(mWriteLock);
+    fflush(mFile);
+}
+
+void XLooperRecorder::drain() {
+    lock_guard<mutex> writeLock(mWriteLock);
+    {
+        lock_guard<mutex> autoLock(mLock);
+        if (mPending.empty()) {
+            return;
+        }
+        mWriting.swap(mPending);
+    }
+    fwrite(mWriting.data(), mWriting.size(), 1, mFile);
+    mWriting.clear();
+}
+
+void XLooperRecorder::append(const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *)data;
+    mPending.insert(mPending.end(), bytes, bytes + size);
+}
+
+void XLooperRecorder::record(XLooper *looper, const char *looperName,
+        const shared_ptr<XMessage> &msg, int64_t postUs, int64_t whenUs,
+        int64_t periodUs, int32_t periodicPolicy) {
+    size_t length = msg->encodedSize();
+    if (length == 0) {
+        // typed or unencodable
+        return;
+    }
+
+    lock_guard<mutex> autoLock(mLock);
+    RecordHeader header;
+    memset(&header, 0, sizeof(header));
+
+    map<XLooper *, uint32_t>::iterator it = mLoopers.find(looper);
+    if (it == mLoopers.end()) {
+        uint32_t index = (uint32_t)mLoopers.size();
+        it = mLoopers.insert(make_pair(looper, index)).first;
+
+        header.mType = kRecordLooper;
+        header.mLength = (uint32_t)strlen(looperName);
+        header.mLooperIndex = index;
+        append(&header, sizeof(header));
+        append(looperName, header.mLength);
+    }
+
+    header.mType = kRecordMessage;
+    header.mLength = (uint32_t)length;
+    header.mPostUs = postUs;
+    header.mDelayUs = whenUs - postUs;
+    header.mHandlerID = msg->mTarget;
+    header.mLooperIndex = it->second;
+    header.mPriority = msg->mPriority;
+    header.mDeadlinePolicy = msg->mDeadlinePolicy;
+    header.mDeadlineUs = msg->mDeadlineUs == INT64_MAX ? INT64_MAX : msg->mDeadlineUs - whenUs;
+    header.mPeriodUs = periodUs;
+    header.mPeriodicPolicy = periodicPolicy;
+    append(&header, sizeof(header));
+
+    size_t offset = mPending.size();
+    mPending.resize(offset + length);
+    msg->encode(mPending.data() + offset);
+}
+
+shared_ptr<XLooperReplayer> XLooperReplayer::open(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        XLOGE("replayer: failed to open %s", path);
+        return nullptr;
+    }
+
+    uint32_t magic[2];
+    if (fread(magic, sizeof(magic), 1, file) != 1
+            || magic[0] != XLooperRecorder::kMagic
+            || magic[1] != XLooperRecorder::kVersion) {
+        XLOGE("replayer: %s is not a looper recording", path);
+        fclose(file);
+        return nullptr;
+    }
+
+    shared_ptr<XLooperReplayer> replayer =
+        shared_ptr<XLooperReplayer>(new XLooperReplayer());
+    XLooperRecorder::RecordHeader header;
+    while (fread(&header, sizeof(header), 1, file) == 1) {
+        vector<uint8_t> payload(header.mLength);
+        if (header.mLength > 0 && fread(payload.data(), header.mLength, 1, file) != 1) {
+            XLOGE("replayer: truncated recording");
+            break;
+        }
+        if (header.mType != XLooperRecorder::kRecordMessage) {
+            continue;
+        }
+
+        replayer->mRecords.push_back(Record());
+        Record &record = replayer->mRecords.back();
+        record.mPostUs = header.mPostUs;
+        record.mDelayUs = header.mDelayUs;
+        record.mHandlerID = header.mHandlerID;
+        record.mPriority = header.mPriority;
+        record.mDeadlinePolicy = header.mDeadlinePolicy;
+        record.mDeadlineUs = header.mDeadlineUs;
+        record.mPeriodUs = header.mPeriodUs;
+        record.mPeriodicPolicy = header.mPeriodicPolicy;
+        record.mPayload.swap(payload);
+    }
+    fclose(file);
+    return replayer;
+}
+
+void XLooperReplayer::setTarget(
+        XLooper::handler_id recordedID, shared_ptr<XHandler> handler) {
+    mTargets[recordedID] = handler;
+}
+
+void XLooperReplayer::setDefaultTarget(shared_ptr<XHandler> handler) {
+    mDefaultTarget = handler;
+}
+
+size_t XLooperReplayer::size() const {
+    return mRecords.size();
+}
+
+shared_ptr<XHandler> XLooperReplayer::targetFor(XLooper::handler_id id) const {
+    map<XLooper::handler_id, weak_ptr<XHandler> >::const_iterator it = mTargets.find(id);
+    if (it != mTargets.end()) {
+        return it->second.lock();
+    }
+    return mDefaultTarget.lock();
+}
+
+static bool isDueEarlier(const pair<int64_t, size_t> &a, const pair<int64_t, size_t> &b) {
+    return a.first < b.first;
+}
+
+size_t XLooperReplayer::replay(Mode mode) {
+    if (mRecords.empty()) {
+        return 0;
+    }
+
+    // due time of each record in recording time, posts are replayed in
+    // stream order, fast mode reorders them by due time instead
+    vector<pair<int64_t, size_t> > order;
+    order.reserve(mRecords.size());
+    for (size_t i = 0; i < mRecords.size(); ++i) {
+        const Record &record = mRecords[i];
+        int64_t dueUs = mode == kModeAsFastAsPossible
+            ? record.mPostUs + (record.mDelayUs > 0 ? record.mDelayUs : 0)
+            : record.mPostUs;
+        order.push_back(make_pair(dueUs, i));
+    }
+    stable_sort(order.begin(), order.end(), isDueEarlier);
+
+    int64_t baseRecordedUs = mRecords[order[0].second].mPostUs;
+    int64_t baseRealUs = XLooper::GetNowUs();
+    size_t posted = 0;
+    for (size_t i = 0; i < order.size(); ++i) {
+        const Record &record = mRecords[order[i].second];
+        shared_ptr<XHandler> handler = targetFor(record.mHandlerID);
+        if (handler == nullptr) {
+            continue;
+        }
+
+        shared_ptr<XMessage> msg = XMessage::decode(
+                record.mPayload.data(), record.mPayload.size(), handler);
+        if (msg == nullptr) {
+            continue;
+        }
+        msg->setPriority(record.mPriority);
+        msg->setDeadlinePolicy(record.mDeadlinePolicy);
+
+        int64_t delayUs = 0;
+        if (mode == kModeOriginalTiming) {
+            int64_t targetUs = baseRealUs + (record.mPostUs - baseRecordedUs);
+            int64_t nowUs = XLooper::GetNowUs();
+            if (targetUs > nowUs) {
+                this_thread::sleep_for(chrono::microseconds(targetUs - nowUs));
+            }
+            delayUs = record.mDelayUs;
+        }
+        if (record.mPeriodUs > 0) {
+            // deadlines don't apply to periodic messages
+            shared_ptr<XLooper> looper = handler->getLooper().lock();
+            XLooper::PeriodicPolicy policy = record.mPeriodicPolicy == XLooper::kPeriodicCatchUp
+                ? XLooper::kPeriodicCatchUp : XLooper::kPeriodicSkip;
+            if (looper != nullptr
+                    && looper->postPeriodic(msg, record.mPeriodUs, delayUs, policy) == 0) {
+                ++posted;
+            }
+            continue;
+        }
+        if (record.mDeadlineUs != INT64_MAX) {
+            // same slack past the due time as recorded, in the target's time
+            shared_ptr<XLooper> looper = handler->getLooper().lock();
+            int64_t dueUs = (looper != nullptr ? looper->nowUs() : XLooper::GetNowUs())
+                + (delayUs > 0 ? delayUs : 0);
+            msg->setDeadline(dueUs + record.mDeadlineUs);
+        }
+        msg->post(delayUs);
+        ++posted;
+    }
+    return posted;
+}
@@ -0,0 +1,131 @@
+//
+//  XLooperRecorder.hpp
+//  foundation
+//
+
+#ifndef XLooperRecorder_hpp
+#define XLooperRecorder_hpp
+
+#include <stdio.h>
+#include <map>
+#include <vector>
+#include "XHandler.h"
+
+// Streams every message posted to the loopers it is attached to into a
+// compact binary file: post time, delay, target handler id, priority,
+// deadline, period, what() and the items (XMessage::encode()). A periodic
+// message is recorded once, when posted, not at each tick. Posts only append
+// to an in-memory buffer under the looper lock, the file is written once
+// the looper lock has been released. Attach with XLooper::setRecorder(); one
+// recorder may serve several loopers, MediaClock included
+// (clock->getLooper().lock()->setRecorder(recorder)).
+//
+// Callables posted with XLooper::post(XRunnable) and XTypedMessage payloads
+// can't be serialized and are not recorded.
+class XLooperRecorder
+{
+public:
+    static shared_ptr<XLooperRecorder> create(const char *path);
+    virtual ~XLooperRecorder();
+
+    void flush();
+
+private:
+    friend class XLooper;
+    friend class XLooperReplayer;
+
+    enum {
+        kMagic = 'XLRc',
+        kVersion = 3,
+    };
+
+    enum RecordType {
+        kRecordMessage = 1,
+        // payload is the looper name, sent once per looper
+        kRecordLooper = 2,
+    };
+
+    struct RecordHeader {
+        uint32_t mType;
+        uint32_t mLength;           // payload bytes following the header
+        int64_t  mPostUs;
+        int64_t  mDelayUs;
+        int32_t  mHandlerID;
+        uint32_t mLooperIndex;
+        int32_t  mPriority;
+        int32_t  mDeadlinePolicy;
+        int64_t  mDeadlineUs;       // relative to the due time, INT64_MAX for none
+        int64_t  mPeriodUs;         // > 0 for postPeriodic()
+        int32_t  mPeriodicPolicy;
+        uint32_t mReserved;
+    };
+
+    XLooperRecorder(FILE *file);
+    // Called under the looper lock, only appends to mPending.
+    void record(XLooper *looper, const char *looperName,
+            const shared_ptr<XMessage> &msg, int64_t postUs, int64_t whenUs,
+            int64_t periodUs, int32_t periodicPolicy);
+    // Called once the looper lock is released, writes mPending out.
+    void drain();
+    void append(const void *data, size_t size);
+
+    mutex mLock;
+    map<XLooper *, uint32_t> mLoopers;
+    vector<uint8_t> mPending;
+
+    // serializes the file writes, taken before mLock
+    mutex mWriteLock;
+    FILE *mFile;
+    vector<uint8_t> mWriting;
+};
+
+// Re-injects a recording into live handlers, either at the original pace
+// or back to back, so queue and handler changes can be benchmarked against
+// captured production traffic.
+class XLooperReplayer
+{
+public:
+    enum Mode {
+        // reproduce the recorded gaps between posts and their delays
+        kModeOriginalTiming,
+        // post everything immediately, in the recorded due-time order
+        kModeAsFastAsPossible,
+    };
+
+    static shared_ptr<XLooperReplayer> open(const char *path);
+
+    // Messages recorded for |recordedID| go to |handler|, anything without
+    // an explicit mapping goes to the default target (or is skipped).
+    void setTarget(XLooper::handler_id recordedID, shared_ptr<XHandler> handler);
+    void setDefaultTarget(shared_ptr<XHandler> handler);
+
+    size_t size() const;
+
+    // Blocks until every record has been posted, returns the number of
+    // messages posted. A recorded periodic message is posted with
+    // XLooper::postPeriodic() and keeps ticking until its target handler is
+    // unregistered.
+    size_t replay(Mode mode);
+
+private:
+    struct Record {
+        int64_t mPostUs;
+        int64_t mDelayUs;
+        XLooper::handler_id mHandlerID;
+        int32_t mPriority;
+        int32_t mDeadlinePolicy;
+        int64_t mDeadlineUs;
+        int64_t mPeriodUs;
+        int32_t mPeriodicPolicy;
+        vector<uint8_t> mPayload;
+    };
+
+    XLooperReplayer() {}
+    shared_ptr<XHandler> targetFor(XLooper::handler_id id) const;
+
+    vector<Record> mRecords;
+    map<XLooper::handler_id, weak_ptr<XHandler> > mTargets;
+    weak_ptr<XHandler> mDefaultTarget;
+};
+
+#endif /* XLooperRecorder_hpp */
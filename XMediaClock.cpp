@@ -24,10 +24,17 @@
  * limitations under the License.
  */
 
-//#define LOG_NDEBUG 0
+//#define XLOG_MIN_LEVEL 2
 #define LOG_TAG "MediaClock"
 #include <map>
 #include "XMessage.h"
+#include "XLog.h"
+
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#elif defined(__AVX512F__) && defined(__AVX512DQ__)
+#include <immintrin.h>
+#endif
 
 
 #define OK (0)
@@ -35,33 +42,107 @@
 // If larger than this threshold, it's treated as discontinuity.
 static const int64_t kAnchorFluctuationAllowedUs = 10000LL;
 
-MediaClock::Timer::Timer(shared_ptr<XMessage> notify, int64_t mediaTimeUs, int64_t adjustRealUs)
+MediaClock::Timer::Timer(shared_ptr<XMessage> notify, int64_t mediaTimeUs, int64_t adjustRealUs,
+        timer_id id, int32_t group)
     : mNotify(notify),
       mMediaTimeUs(mediaTimeUs),
-      mAdjustRealUs(adjustRealUs) {
+      mAdjustRealUs(adjustRealUs),
+      mID(id),
+      mGroup(group) {
+}
+
+MediaClock::SyncStats::SyncStats()
+    : mTimersFired(0),
+      mMaxLateUs(0),
+      mTotalLateUs(0),
+      mTimersReset(0),
+      mTimersCancelled(0),
+      mReanchors(0),
+      mGenerationBumps(0),
+      mStaleWakeups(0),
+      mProcessCount(0),
+      mProcessTotalUs(0),
+      mProcessMaxUs(0) {
+    for (int i = 0; i < kLatenessBuckets; ++i) {
+        mLateness[i] = 0;
+    }
 }
 
 MediaClock::MediaClock()
-    : mAnchorTimeMediaUs(-1),
+    : mLock(make_shared<mutex>()),
+      mParentOffsetUs(0),
+      mParentRateMultiplier(1.0),
+      mAnchorTimeMediaUs(-1),
       mAnchorTimeRealUs(-1),
       mMaxTimeMediaUs(INT64_MAX),
       mStartingTimeMediaUs(-1),
       mPlaybackRate(1.0),
       mGeneration(0),
+      mNextTimerID(0),
       mNotify(NULL) {
     mLooper = XLooper::createLooper();
     mLooper->setName("MediaClock");
     mLooper->start();
 }
 
+MediaClock::MediaClock(shared_ptr<MediaClock> parent, int64_t offsetUs, float rateMultiplier)
+    : mLooper(parent->mLooper),
+      mLock(parent->mLock),
+      mParent(parent),
+      mParentOffsetUs(offsetUs),
+      mParentRateMultiplier(rateMultiplier),
+      mAnchorTimeMediaUs(-1),
+      mAnchorTimeRealUs(-1),
+      mMaxTimeMediaUs(INT64_MAX),
+      mStartingTimeMediaUs(-1),
+      mPlaybackRate(1.0),
+      mGeneration(0),
+      mNextTimerID(0),
+      mNotify(NULL) {
+    lock_guard<mutex> autoLock(*mLock);
+    mParent->mChildren.push_back(this);
+    deriveAnchor_l();
+}
+
 void MediaClock::init(shared_ptr<XHandler> handler) {
     XHandler::init(handler);
-    mLooper->registerHandler(this);
+    // the root handles the wakeups of the whole tree
+    if (mParent == nullptr) {
+        mLooper->registerHandler(this);
+    }
+}
+
+int MediaClock::setParentMapping(int64_t offsetUs, float rateMultiplier) {
+    lock_guard<mutex> autoLock(*mLock);
+    if (mParent == nullptr) {
+        return -1;
+    }
+    mParentOffsetUs = offsetUs;
+    mParentRateMultiplier = rateMultiplier;
+    deriveAnchor_l();
+    rescheduleTimers_l();
+    return OK;
+}
+
+void MediaClock::setTimeSource(shared_ptr<XTimeSource> timeSource) {
+    lock_guard<mutex> autoLock(*mLock);
+    mLooper->setTimeSource(timeSource);
 }
 
 MediaClock::~MediaClock() {
-    printf("~MediaClock\n");
+    XLOGV("~MediaClock");
     reset();
+    if (mParent != nullptr) {
+        lock_guard<mutex> autoLock(*mLock);
+        vector<MediaClock *> &siblings = mParent->mChildren;
+        for (size_t i = 0; i < siblings.size(); ++i) {
+            if (siblings[i] == this) {
+                siblings.erase(siblings.begin() + i);
+                break;
+            }
+        }
+        return;
+    }
     if (mLooper != NULL) {
         mLooper->unregisterHandler(this);
         mLooper->stop();
@@ -69,26 +150,34 @@ MediaClock::~MediaClock() {
 }
 
 void MediaClock::reset() {
-    lock_guard<mutex> autoLock(mLock);
+    lock_guard<mutex> autoLock(*mLock);
     auto it = mTimers.begin();
     while (it != mTimers.end()) {
         it->mNotify->setInt32("reason", TIMER_REASON_RESET);
         it->mNotify->post();
-        it = mTimers.erase(it);
+        it = eraseTimer_l(it);
+        mSyncStats.mTimersReset++;
     }
     mMaxTimeMediaUs = INT64_MAX;
     mStartingTimeMediaUs = -1;
-    updateAnchorTimesAndPlaybackRate_l(-1, -1, 1.0);
-    ++mGeneration;
+    if (mParent == nullptr) {
+        updateAnchorTimesAndPlaybackRate_l(-1, -1, 1.0);
+    }
+    syncTimelines_l();
+    rescheduleTimers_l();
 }
 
 void MediaClock::setStartingTimeMedia(int64_t startingTimeMediaUs) {
-    lock_guard<mutex> autoLock(mLock);
+    lock_guard<mutex> autoLock(*mLock);
     mStartingTimeMediaUs = startingTimeMediaUs;
 }
 
 void MediaClock::clearAnchor() {
-    lock_guard<mutex> autoLock(mLock);
+    lock_guard<mutex> autoLock(*mLock);
+    if (mParent != nullptr) {
+        XLOGW("clearAnchor: ignored on a slave clock.");
+        return;
+    }
     updateAnchorTimesAndPlaybackRate_l(-1, -1, mPlaybackRate);
 }
 
@@ -97,21 +186,26 @@ void MediaClock::updateAnchor(
         int64_t anchorTimeRealUs,
         int64_t maxTimeMediaUs) {
     if (anchorTimeMediaUs < 0 || anchorTimeRealUs < 0) {
-        printf("reject anchor time since it is negative.");
+        XLOGW("reject anchor time since it is negative.");
         return;
     }
 
-    lock_guard<mutex> autoLock(mLock);
-    int64_t nowUs = XLooper::GetNowUs();
+    lock_guard<mutex> autoLock(*mLock);
+    if (mParent != nullptr) {
+        XLOGW("updateAnchor: ignored on a slave clock.");
+        return;
+    }
+    int64_t nowUs = mLooper->nowUs();
     int64_t nowMediaUs =
         anchorTimeMediaUs + (nowUs - anchorTimeRealUs) * (double)mPlaybackRate;
     if (nowMediaUs < 0) {
-        printf("reject anchor time since it leads to negative media time.");
+        XLOGW("reject anchor time since it leads to negative media time.");
         return;
     }
 
-    if (maxTimeMediaUs != -1) {
+    if (maxTimeMediaUs != -1 && maxTimeMediaUs != mMaxTimeMediaUs) {
         mMaxTimeMediaUs = maxTimeMediaUs;
+        syncTimelines_l();
     }
     if (mAnchorTimeRealUs != -1) {
         int64_t oldNowMediaUs =
@@ -122,40 +216,45 @@ void MediaClock::updateAnchor(
         }
     }
     updateAnchorTimesAndPlaybackRate_l(nowMediaUs, nowUs, mPlaybackRate);
-
-    ++mGeneration;
-    processTimers_l();
+    rescheduleTimers_l();
 }
 
 void MediaClock::updateMaxTimeMedia(int64_t maxTimeMediaUs) {
-    lock_guard<mutex> autoLock(mLock);
+    lock_guard<mutex> autoLock(*mLock);
     mMaxTimeMediaUs = maxTimeMediaUs;
+    syncTimelines_l();
 }
 
 void MediaClock::setPlaybackRate(float rate) {
     //CHECK_GE(rate, 0.0);
-    lock_guard<mutex> autoLock(mLock);
+    lock_guard<mutex> autoLock(*mLock);
+    if (mParent != nullptr) {
+        XLOGW("setRate: ignored on a slave clock.");
+        return;
+    }
     if (mAnchorTimeRealUs == -1) {
         mPlaybackRate = rate;
+        for (size_t i = 0; i < mChildren.size(); ++i) {
+            mChildren[i]->deriveAnchor_l();
+        }
         return;
     }
 
-    int64_t nowUs = XLooper::GetNowUs();
+    int64_t nowUs = mLooper->nowUs();
     int64_t nowMediaUs = mAnchorTimeMediaUs + (nowUs - mAnchorTimeRealUs) * (double)mPlaybackRate;
     if (nowMediaUs < 0) {
-        printf("setRate: anchor time should not be negative, set to 0.");
+        XLOGW("setRate: anchor time should not be negative, set to 0.");
         nowMediaUs = 0;
     }
     updateAnchorTimesAndPlaybackRate_l(nowMediaUs, nowUs, rate);
 
     if (rate > 0.0) {
-        ++mGeneration;
-        processTimers_l();
+        rescheduleTimers_l();
     }
 }
 
 float MediaClock::getPlaybackRate() {
-    lock_guard<mutex> autoLock(mLock);
+    lock_guard<mutex> autoLock(*mLock);
     return mPlaybackRate;
 }
 
@@ -165,7 +264,7 @@ int MediaClock::getMediaTime(
         return -1;
     }
 
-    lock_guard<mutex> autoLock(mLock);
+    lock_guard<mutex> autoLock(*mLock);
     return getMediaTime_l(realUs, outMediaUs, allowPastMaxTime);
 }
 
@@ -196,12 +295,12 @@ int MediaClock::getRealTimeFor(
         return -1;
     }
 
-    lock_guard<mutex> autoLock(mLock);
+    lock_guard<mutex> autoLock(*mLock);
     if (mPlaybackRate == 0.0) {
         return -1;
     }
 
-    int64_t nowUs = XLooper::GetNowUs();
+    int64_t nowUs = mLooper->nowUs();
     int64_t nowMediaUs;
     int status =
             getMediaTime_l(nowUs, &nowMediaUs, true /* allowPastMaxTime */);
@@ -212,9 +311,128 @@ int MediaClock::getRealTimeFor(
     return OK;
 }
 
-void MediaClock::addTimer(shared_ptr<XMessage> notify, int64_t mediaTimeUs,
-                          int64_t adjustRealUs) {
-    lock_guard<mutex> autoLock(mLock);
+// Both conversions are an affine map of the clock's state:
+//     out = clamp((in - inOrigin) * mul / div + outOrigin, min, max)
+// with one of mul/div 1.0, so each lane computes exactly what the scalar
+// formula does.
+struct AffineMap {
+    int64_t mInOrigin;
+    double mOutOrigin;
+    double mMul;
+    double mDiv;
+    int64_t mMin;
+    int64_t mMax;
+};
+
+static inline int64_t mapOne(const AffineMap &map, int64_t in) {
+    int64_t out = (in - map.mInOrigin) * map.mMul / map.mDiv + map.mOutOrigin;
+    if (out > map.mMax) {
+        out = map.mMax;
+    }
+    if (out < map.mMin) {
+        out = map.mMin;
+    }
+    return out;
+}
+
+static void mapBatch(const AffineMap &map, const int64_t *in, int64_t *out, size_t count) {
+    size_t i = 0;
+#if defined(__aarch64__)
+    const int64x2_t inOrigin = vdupq_n_s64(map.mInOrigin);
+    const float64x2_t outOrigin = vdupq_n_f64(map.mOutOrigin);
+    const float64x2_t mul = vdupq_n_f64(map.mMul);
+    const float64x2_t div = vdupq_n_f64(map.mDiv);
+    const int64x2_t lo = vdupq_n_s64(map.mMin);
+    const int64x2_t hi = vdupq_n_s64(map.mMax);
+    for (; i + 2 <= count; i += 2) {
+        float64x2_t d = vcvtq_f64_s64(vsubq_s64(vld1q_s64(in + i), inOrigin));
+        d = vaddq_f64(vdivq_f64(vmulq_f64(d, mul), div), outOrigin);
+        int64x2_t v = vcvtq_s64_f64(d);
+        v = vbslq_s64(vcgtq_s64(v, hi), hi, v);
+        v = vbslq_s64(vcltq_s64(v, lo), lo, v);
+        vst1q_s64(out + i, v);
+    }
+#elif defined(__AVX512F__) && defined(__AVX512DQ__)
+    const __m512i inOrigin = _mm512_set1_epi64(map.mInOrigin);
+    const __m512d outOrigin = _mm512_set1_pd(map.mOutOrigin);
+    const __m512d mul = _mm512_set1_pd(map.mMul);
+    const __m512d div = _mm512_set1_pd(map.mDiv);
+    const __m512i lo = _mm512_set1_epi64(map.mMin);
+    const __m512i hi = _mm512_set1_epi64(map.mMax);
+    for (; i + 8 <= count; i += 8) {
+        __m512d d = _mm512_cvtepi64_pd(
+                _mm512_sub_epi64(_mm512_loadu_si512(in + i), inOrigin));
+        d = _mm512_add_pd(_mm512_div_pd(_mm512_mul_pd(d, mul), div), outOrigin);
+        __m512i v = _mm512_cvttpd_epi64(d);
+        v = _mm512_mask_blend_epi64(_mm512_cmpgt_epi64_mask(v, hi), v, hi);
+        v = _mm512_mask_blend_epi64(_mm512_cmplt_epi64_mask(v, lo), v, lo);
+        _mm512_storeu_si512(out + i, v);
+    }
+#endif
+    for (; i < count; ++i) {
+        out[i] = mapOne(map, in[i]);
+    }
+}
+
+int MediaClock::getMediaTimes(const int64_t *realUs, int64_t *outMediaUs, size_t count,
+        bool allowPastMaxTime) {
+    if (realUs == NULL || outMediaUs == NULL) {
+        return -1;
+    }
+
+    lock_guard<mutex> autoLock(*mLock);
+    if (mAnchorTimeRealUs == -1) {
+        return -2;
+    }
+
+    AffineMap map;
+    map.mInOrigin = mAnchorTimeRealUs;
+    map.mOutOrigin = mAnchorTimeMediaUs;
+    map.mMul = mPlaybackRate;
+    map.mDiv = 1.0;
+    // getMediaTime_l() clamps to the max, then the start, then 0
+    map.mMax = allowPastMaxTime ? INT64_MAX : mMaxTimeMediaUs;
+    map.mMin = mStartingTimeMediaUs > 0 ? mStartingTimeMediaUs : 0;
+    if (map.mMax < map.mMin) {
+        map.mMax = map.mMin;
+    }
+    mapBatch(map, realUs, outMediaUs, count);
+    return OK;
+}
+
+int MediaClock::getRealTimesFor(const int64_t *targetMediaUs, int64_t *outRealUs,
+        size_t count) {
+    if (targetMediaUs == NULL || outRealUs == NULL) {
+        return -1;
+    }
+
+    lock_guard<mutex> autoLock(*mLock);
+    if (mPlaybackRate == 0.0) {
+        return -1;
+    }
+
+    int64_t nowUs = mLooper->nowUs();
+    int64_t nowMediaUs;
+    int status =
+            getMediaTime_l(nowUs, &nowMediaUs, true /* allowPastMaxTime */);
+    if (status != OK) {
+        return status;
+    }
+
+    AffineMap map;
+    map.mInOrigin = nowMediaUs;
+    map.mOutOrigin = nowUs;
+    map.mMul = 1.0;
+    map.mDiv = mPlaybackRate;
+    map.mMin = INT64_MIN;
+    map.mMax = INT64_MAX;
+    mapBatch(map, targetMediaUs, outRealUs, count);
+    return OK;
+}
+
+MediaClock::timer_id MediaClock::addTimer(shared_ptr<XMessage> notify, int64_t mediaTimeUs,
+                          int64_t adjustRealUs, int32_t group) {
+    lock_guard<mutex> autoLock(*mLock);
 
     bool updateTimer = (mPlaybackRate != 0.0);
     if (updateTimer) {
@@ -229,12 +447,57 @@ void MediaClock::addTimer(shared_ptr<XMessage> notify, int64_t mediaTimeUs,
         }
     }
 
-    mTimers.emplace_back(notify, mediaTimeUs, adjustRealUs);
+    timer_id id = ++mNextTimerID;
+    mTimers.emplace_back(notify, mediaTimeUs, adjustRealUs, id, group);
+    mTimerIndex[id] = --mTimers.end();
 
     if (updateTimer) {
-        ++mGeneration;
-        processTimers_l();
+        rescheduleTimers_l();
+    }
+    return id;
+}
+
+// A wakeup already scheduled for a removed timer is left alone, it finds
+// nothing due and reschedules for the remaining timers.
+int MediaClock::cancelTimer(timer_id id, bool postNotify) {
+    lock_guard<mutex> autoLock(*mLock);
+    auto found = mTimerIndex.find(id);
+    if (found == mTimerIndex.end()) {
+        return -1;
+    }
+
+    if (postNotify) {
+        found->second->mNotify->setInt32("reason", TIMER_REASON_CANCELLED);
+        found->second->mNotify->post();
+    }
+    eraseTimer_l(found->second);
+    mSyncStats.mTimersCancelled++;
+    return OK;
+}
+
+size_t MediaClock::cancelTimers(int32_t group, bool postNotify) {
+    lock_guard<mutex> autoLock(*mLock);
+    size_t count = 0;
+    auto it = mTimers.begin();
+    while (it != mTimers.end()) {
+        if (it->mGroup != group) {
+            ++it;
+            continue;
+        }
+        if (postNotify) {
+            it->mNotify->setInt32("reason", TIMER_REASON_CANCELLED);
+            it->mNotify->post();
+        }
+        it = eraseTimer_l(it);
+        ++count;
     }
+    mSyncStats.mTimersCancelled += count;
+    return count;
+}
+
+std::list<MediaClock::Timer>::iterator MediaClock::eraseTimer_l(std::list<Timer>::iterator it) {
+    mTimerIndex.erase(it->mID);
+    return mTimers.erase(it);
 }
 
 void MediaClock::onMessageReceived(shared_ptr<XMessage> msg) {
@@ -244,12 +507,13 @@ void MediaClock::onMessageReceived(shared_ptr<XMessage> msg) {
             int32_t generation;
             if(!msg->findInt32("generation", &generation))
             {
-                printf("generation get failed!\n");
+                XLOGE("generation get failed!");
                 break;
             }
 
-            lock_guard<mutex> autoLock(mLock);
+            lock_guard<mutex> autoLock(*mLock);
             if (generation != mGeneration) {
+                mSyncStats.mStaleWakeups++;
                 break;
             }
             processTimers_l();
@@ -257,15 +521,59 @@ void MediaClock::onMessageReceived(shared_ptr<XMessage> msg) {
         }
 
         default:
-            printf("should not be here!\n");
+            XLOGE("should not be here!");
             break;
     }
 }
 
+MediaClock *MediaClock::root_l() {
+    MediaClock *clock = this;
+    while (clock->mParent != nullptr) {
+        clock = clock->mParent.get();
+    }
+    return clock;
+}
+
+// Drops the wakeup pending for the tree and schedules one for its timers.
+void MediaClock::rescheduleTimers_l() {
+    MediaClock *root = root_l();
+    ++root->mGeneration;
+    root->mSyncStats.mGenerationBumps++;
+    root->processTimers_l();
+}
+
+// Called on the root clock: fires due timers across the tree and schedules
+// a single wakeup for the earliest one left.
 void MediaClock::processTimers_l() {
+    // steady clock, a virtual time source doesn't move while we work
+    int64_t startUs = XLooper::GetNowUs();
+    int64_t nextLapseRealUs = INT64_MAX;
+    processTreeTimers_l(mLooper->nowUs(), &nextLapseRealUs);
+    if (nextLapseRealUs != INT64_MAX) {
+        shared_ptr<XMessage> msg = XMessage::obtainMsg(kWhatTimeIsUp, handler());
+        msg->setInt32("generation", mGeneration);
+        msg->post(nextLapseRealUs);
+    }
+
+    int64_t elapsedUs = XLooper::GetNowUs() - startUs;
+    mSyncStats.mProcessCount++;
+    mSyncStats.mProcessTotalUs += elapsedUs;
+    if (elapsedUs > mSyncStats.mProcessMaxUs) {
+        mSyncStats.mProcessMaxUs = elapsedUs;
+    }
+}
+
+void MediaClock::processTreeTimers_l(int64_t nowUs, int64_t *nextLapseRealUs) {
+    processOwnTimers_l(nowUs, nextLapseRealUs);
+    for (size_t i = 0; i < mChildren.size(); ++i) {
+        mChildren[i]->processTreeTimers_l(nowUs, nextLapseRealUs);
+    }
+}
+
+void MediaClock::processOwnTimers_l(int64_t nowUs, int64_t *outNextLapseRealUs) {
     int64_t nowMediaTimeUs;
     int status = getMediaTime_l(
-            XLooper::GetNowUs(), &nowMediaTimeUs, false /* allowPastMaxTime */);
+            nowUs, &nowMediaTimeUs, false /* allowPastMaxTime */);
 
     if (status != OK) {
         return;
@@ -287,8 +595,9 @@ void MediaClock::processTimers_l() {
         }
 
         if (diffMediaUs <= 0) {
+            recordLateness_l(diffMediaUs == INT64_MIN ? INT64_MAX : -diffMediaUs);
             notifyList.emplace(diffMediaUs, *it);
-            it = mTimers.erase(it);
+            it = eraseTimer_l(it);
         } else {
             if (mPlaybackRate != 0.0
                 && (double)diffMediaUs < (double)INT64_MAX * (double)mPlaybackRate) {
@@ -304,7 +613,7 @@ void MediaClock::processTimers_l() {
     auto itNotify = notifyList.begin();
     while (itNotify != notifyList.end()) {
         itNotify->second.mNotify->setInt32("reason", TIMER_REASON_REACHED);
-        printf("post %d\n",itNotify->second.mNotify->what());
+        XLOGV("post %d", itNotify->second.mNotify->what());
         itNotify->second.mNotify->post();
         itNotify = notifyList.erase(itNotify);
     }
@@ -313,10 +622,9 @@ void MediaClock::processTimers_l() {
         || nextLapseRealUs == INT64_MAX) {
         return;
     }
-
-    shared_ptr<XMessage> msg = XMessage::obtainMsg(kWhatTimeIsUp, handler());
-    msg->setInt32("generation", mGeneration);
-    msg->post(nextLapseRealUs);
+    if (nextLapseRealUs < *outNextLapseRealUs) {
+        *outNextLapseRealUs = nextLapseRealUs;
+    }
 }
 
 void MediaClock::updateAnchorTimesAndPlaybackRate_l(int64_t anchorTimeMediaUs,
@@ -327,15 +635,110 @@ void MediaClock::updateAnchorTimesAndPlaybackRate_l(int64_t anchorTimeMediaUs,
         mAnchorTimeMediaUs = anchorTimeMediaUs;
         mAnchorTimeRealUs = anchorTimeRealUs;
         mPlaybackRate = playbackRate;
+        mSyncStats.mReanchors++;
         notifyDiscontinuity_l();
+        syncTimelines_l();
+        for (size_t i = 0; i < mChildren.size(); ++i) {
+            mChildren[i]->deriveAnchor_l();
+        }
+    }
+}
+
+// Recomputes a slave's anchor from its parent's, and on down the tree.
+void MediaClock::deriveAnchor_l() {
+    float rate = mParent->mPlaybackRate * mParentRateMultiplier;
+    if (mParent->mAnchorTimeRealUs == -1) {
+        updateAnchorTimesAndPlaybackRate_l(-1, -1, rate);
+        return;
+    }
+    updateAnchorTimesAndPlaybackRate_l(
+            mParent->mAnchorTimeMediaUs * (double)mParentRateMultiplier + mParentOffsetUs,
+            mParent->mAnchorTimeRealUs, rate);
+}
+
+int MediaClock::attachTimeline(const shared_ptr<XLooper> &looper, XLooper::timeline_id id) {
+    if (looper == nullptr) {
+        return -1;
+    }
+
+    lock_guard<mutex> autoLock(*mLock);
+    if (looper->setTimelineMapping(id, mAnchorTimeMediaUs, mAnchorTimeRealUs,
+            mPlaybackRate, mMaxTimeMediaUs) != OK) {
+        return -1;
+    }
+    AttachedTimeline timeline;
+    timeline.mLooper = looper;
+    timeline.mID = id;
+    mTimelines.push_back(timeline);
+    return OK;
+}
+
+void MediaClock::detachTimeline(const shared_ptr<XLooper> &looper, XLooper::timeline_id id) {
+    lock_guard<mutex> autoLock(*mLock);
+    for (size_t i = 0; i < mTimelines.size(); ++i) {
+        if (mTimelines[i].mID == id && mTimelines[i].mLooper.lock() == looper) {
+            mTimelines.erase(mTimelines.begin() + i);
+            return;
+        }
+    }
+}
+
+// One mapping update per attached timeline, whatever is queued on it.
+void MediaClock::syncTimelines_l() {
+    size_t i = 0;
+    while (i < mTimelines.size()) {
+        shared_ptr<XLooper> looper = mTimelines[i].mLooper.lock();
+        if (looper == nullptr || looper->setTimelineMapping(mTimelines[i].mID,
+                mAnchorTimeMediaUs, mAnchorTimeRealUs, mPlaybackRate, mMaxTimeMediaUs) != OK) {
+            // the looper or the timeline is gone
+            mTimelines.erase(mTimelines.begin() + i);
+            continue;
+        }
+        ++i;
     }
 }
 
 void MediaClock::setNotificationMessage(shared_ptr<XMessage> msg) {
-    lock_guard<mutex> autoLock(mLock);
+    if (msg != nullptr && msg->isTyped()) {
+        // each notification is a dup() carrying items
+        XLOGW("failed to set a typed notification message.");
+        return;
+    }
+    lock_guard<mutex> autoLock(*mLock);
     mNotify = msg;
 }
 
+void MediaClock::recordLateness_l(int64_t lateUs) {
+    int bucket = 0;
+    int64_t boundUs = kLatenessBucket0Us;
+    while (bucket < kLatenessBuckets - 1 && lateUs >= boundUs) {
+        ++bucket;
+        boundUs *= 2;
+    }
+    mSyncStats.mLateness[bucket]++;
+    mSyncStats.mTimersFired++;
+    // saturates, a timer posted with no finite target reports INT64_MAX
+    mSyncStats.mTotalLateUs = lateUs > INT64_MAX - mSyncStats.mTotalLateUs
+        ? INT64_MAX : mSyncStats.mTotalLateUs + lateUs;
+    if (lateUs > mSyncStats.mMaxLateUs) {
+        mSyncStats.mMaxLateUs = lateUs;
+    }
+}
+
+void MediaClock::getSyncStats(SyncStats *stats) {
+    if (stats == NULL) {
+        return;
+    }
+    lock_guard<mutex> autoLock(*mLock);
+    *stats = mSyncStats;
+    const SyncStats &tree = root_l()->mSyncStats;
+    stats->mGenerationBumps = tree.mGenerationBumps;
+    stats->mStaleWakeups = tree.mStaleWakeups;
+    stats->mProcessCount = tree.mProcessCount;
+    stats->mProcessTotalUs = tree.mProcessTotalUs;
+    stats->mProcessMaxUs = tree.mProcessMaxUs;
+}
+
 void MediaClock::notifyDiscontinuity_l() {
     if (mNotify != nullptr) {
         shared_ptr<XMessage> msg = mNotify->dup();
@@ -9,6 +9,7 @@
 #define XMediaClock_hpp
 
 #include <stdio.h>
+#include <unordered_map>
 #include "XHandler.h"
 
 class XMessage;
@@ -18,11 +19,66 @@ public:
     enum {
         TIMER_REASON_REACHED = 0,
         TIMER_REASON_RESET = 1,
+        TIMER_REASON_CANCELLED = 2,
+    };
+
+    typedef int64_t timer_id;
+
+    enum {
+        // timer lateness buckets: [0, 500us), [500us, 1ms), [1ms, 2ms), ...
+        // doubling up to [32ms, 64ms), then 64ms and over
+        kLatenessBuckets = 9,
+        kLatenessBucket0Us = 500,
+    };
+
+    // A/V sync telemetry since the clock was created, see getSyncStats().
+    struct SyncStats {
+        SyncStats();
+        // timers fired, by how far past their target media time (the
+        // timer's media time plus its real time adjustment at the current
+        // rate) the clock was when they were posted, in media time
+        uint64_t mTimersFired;
+        uint64_t mLateness[kLatenessBuckets];
+        int64_t mMaxLateUs;
+        // saturates at INT64_MAX
+        int64_t mTotalLateUs;
+        uint64_t mTimersReset;
+        uint64_t mTimersCancelled;
+        // anchor or playback rate changes, including those a slave derives
+        // from its parent
+        uint64_t mReanchors;
+        // The rest is kept per clock tree, on the root. Timer re-evaluations
+        // that invalidate the pending wakeup, wakeups that arrived after one
+        // and were discarded, and the real (steady clock) time spent firing
+        // and rescheduling timers.
+        uint64_t mGenerationBumps;
+        uint64_t mStaleWakeups;
+        uint64_t mProcessCount;
+        int64_t mProcessTotalUs;
+        int64_t mProcessMaxUs;
     };
 
     MediaClock();
+    // A slave clock follows |parent|: its media time is
+    //     parent media time * rateMultiplier + offsetUs
+    // and its playback rate is the parent's times |rateMultiplier|. A
+    // slave keeps its own timers, notification message, starting and max
+    // media time, but has no anchor of its own: updateAnchor(),
+    // clearAnchor() and setPlaybackRate() are ignored on it. A clock tree
+    // shares the root's lock, looper and time source, so an anchor or rate
+    // change on the root reaches every slave in one pass and all timers of
+    // the tree are re-evaluated together with a single wakeup.
+    MediaClock(shared_ptr<MediaClock> parent, int64_t offsetUs = 0, float rateMultiplier = 1.0);
     virtual void init(shared_ptr<XHandler> handler);
 
+    // Changes how a slave maps its parent's media time, -1 on a root clock.
+    int setParentMapping(int64_t offsetUs, float rateMultiplier);
+
+    // Real time, including anchor times passed in, is read from |timeSource|
+    // and timers fire against it. Set it before anchoring. See
+    // XLooper::setTimeSource().
+    void setTimeSource(shared_ptr<XTimeSource> timeSource);
+
     void setStartingTimeMedia(int64_t startingTimeMediaUs);
 
     void clearAnchor();
@@ -48,13 +104,45 @@ public:
     // The result is saved in |outRealUs|.
     int getRealTimeFor(int64_t targetMediaUs, int64_t *outRealUs);
 
+    // Batch forms of the two above for |count| timestamps, e.g. every
+    // queued frame per tick: one lock and one reading of the clock for the
+    // whole batch, and SIMD kernels where the build targets them (NEON on
+    // arm64, AVX-512 on x86 builds that enable it). Same formulas as the
+    // single calls. |out| may be the input array.
+    int getMediaTimes(const int64_t *realUs, int64_t *outMediaUs, size_t count,
+            bool allowPastMaxTime = false);
+    int getRealTimesFor(const int64_t *targetMediaUs, int64_t *outRealUs, size_t count);
+
     // request to set up a timer. The target time is |mediaTimeUs|, adjusted by
     // system time of |adjustRealUs|. In other words, the wake up time is
     // mediaTimeUs + (adjustRealUs / playbackRate)
-    void addTimer(shared_ptr<XMessage> notify, int64_t mediaTimeUs, int64_t adjustRealUs = 0);
+    // |group| tags the timer for cancelTimers(), e.g. with a track index.
+    // Returns a handle for cancelTimer().
+    timer_id addTimer(shared_ptr<XMessage> notify, int64_t mediaTimeUs,
+            int64_t adjustRealUs = 0, int32_t group = 0);
+
+    // Removes a pending timer without touching the anchor or other timers.
+    // |notify| is posted with TIMER_REASON_CANCELLED only if |postNotify|.
+    // Returns -1 if the timer already fired or was removed.
+    int cancelTimer(timer_id id, bool postNotify = false);
+    // Same for every pending timer of |group|, e.g. on seek or track
+    // switch. Returns how many were removed.
+    size_t cancelTimers(int32_t group, bool postNotify = false);
+
+    // Keeps timeline |id| of |looper| mapped onto this clock: anchor, rate
+    // and max media time changes are pushed to the looper as they happen,
+    // so messages queued with XLooper::postAtMediaTime() fire on this
+    // clock's media time without a timer here or a wakeup hop through the
+    // clock's looper. |looper| must use the clock's time source. The
+    // starting media time is not applied.
+    int attachTimeline(const shared_ptr<XLooper> &looper, XLooper::timeline_id id);
+    void detachTimeline(const shared_ptr<XLooper> &looper, XLooper::timeline_id id);
 
     void setNotificationMessage(shared_ptr<XMessage> msg);
 
+    // Snapshot of the counters, cheap enough to poll for sync alerts.
+    void getSyncStats(SyncStats *stats);
+
     void reset();
 
     virtual ~MediaClock();
@@ -68,11 +156,19 @@ private:
         kWhatTimeIsUp = 'tIsU',
     };
 
+    struct AttachedTimeline {
+        weak_ptr<XLooper> mLooper;
+        XLooper::timeline_id mID;
+    };
+
     struct Timer {
-        Timer(shared_ptr<XMessage> notify, int64_t mediaTimeUs, int64_t adjustRealUs);
+        Timer(shared_ptr<XMessage> notify, int64_t mediaTimeUs, int64_t adjustRealUs,
+                timer_id id, int32_t group);
         shared_ptr<XMessage> mNotify;
         int64_t mMediaTimeUs;
         int64_t mAdjustRealUs;
+        timer_id mID;
+        int32_t mGroup;
     };
 
     int getMediaTime_l(
@@ -86,9 +182,26 @@ private:
             int64_t anchorTimeMediaUs, int64_t anchorTimeRealUs , float playbackRate);
 
     void notifyDiscontinuity_l();
+    void syncTimelines_l();
+    void recordLateness_l(int64_t lateUs);
+
+    MediaClock *root_l();
+    void deriveAnchor_l();
+    void rescheduleTimers_l();
+    void processTreeTimers_l(int64_t nowUs, int64_t *nextLapseRealUs);
+    void processOwnTimers_l(int64_t nowUs, int64_t *nextLapseRealUs);
 
+    std::list<Timer>::iterator eraseTimer_l(std::list<Timer>::iterator it);
+
+    // shared with the root clock when this is a slave
     shared_ptr<XLooper> mLooper;
-    mutex mLock;
+    shared_ptr<mutex> mLock;
+
+    shared_ptr<MediaClock> mParent;
+    int64_t mParentOffsetUs;
+    float mParentRateMultiplier;
+    // slaves remove themselves under mLock when destroyed
+    vector<MediaClock *> mChildren;
 
     int64_t mAnchorTimeMediaUs;
     int64_t mAnchorTimeRealUs;
@@ -99,7 +212,12 @@ private:
 
     int32_t mGeneration;
     std::list<Timer> mTimers;
+    // pending timers by handle, so cancelTimer() doesn't walk mTimers
+    std::unordered_map<timer_id, std::list<Timer>::iterator> mTimerIndex;
+    timer_id mNextTimerID;
     shared_ptr<XMessage> mNotify;
+    vector<AttachedTimeline> mTimelines;
+    SyncStats mSyncStats;
 
 };
 
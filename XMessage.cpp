@@ -5,8 +5,12 @@
 //  Created by xuwei on 9/22/21.
 //
 
+#define LOG_TAG "XMessage"
+#include <string.h>
+#include <atomic>
 #include "XMessage.h"
 #include "XHandler.h"
+#include "XLog.h"
 
 shared_ptr<XMessage> XMessage::obtainMsg(uint32_t what, shared_ptr<XHandler> handler)
 {
@@ -23,18 +27,28 @@ shared_ptr<XMessage> XMessage::obtainMsg()
 }
 
 XMessage::XMessage(void)
-    : mWhat(0){
+    : mWhat(0),
+      mPriority(XLooper::kPriorityNormal),
+      mDeadlineUs(INT64_MAX),
+      mDeadlinePolicy(XLooper::kDeadlineDeliver),
+      mLateUs(0),
+      mTarget(0),
+      mStore(nullptr){
 }
 
 XMessage::XMessage(uint32_t what, shared_ptr<XHandler> handler)
     : mWhat(what),
-      mNumItems(0){
+      mPriority(XLooper::kPriorityNormal),
+      mDeadlineUs(INT64_MAX),
+      mDeadlinePolicy(XLooper::kDeadlineDeliver),
+      mLateUs(0),
+      mTarget(0),
+      mStore(nullptr){
     setTarget(handler);
 }
 
 XMessage::~XMessage() {
-    clear();
-    printf("delete what = %d\n", mWhat);
+    XLOGV("delete what = %d", mWhat);
 }
 
 void XMessage::setWhat(uint32_t what) {
@@ -45,17 +59,66 @@ uint32_t XMessage::what() const {
     return mWhat;
 }
 
+void XMessage::setPriority(int32_t priority) {
+    mPriority = priority;
+}
+
+int32_t XMessage::priority() const {
+    return mPriority;
+}
+
+void XMessage::setDeadline(int64_t deadlineUs) {
+    mDeadlineUs = deadlineUs;
+}
+
+int64_t XMessage::deadlineUs() const {
+    return mDeadlineUs;
+}
+
+void XMessage::setDeadlinePolicy(int32_t policy) {
+    mDeadlinePolicy = policy;
+}
+
+int32_t XMessage::deadlinePolicy() const {
+    return mDeadlinePolicy;
+}
+
+int64_t XMessage::lateUs() const {
+    return mLateUs;
+}
+
 void XMessage::setTarget(shared_ptr<XHandler> handler) {
     if (handler == NULL) {
-        mHandler.reset();
+        mTarget = 0;
         mLooper.reset();
     } else {
-        mHandler = handler;
-        mLooper = handler->getLooper();
+        mTarget = handler->id();
+        mLooper = handler->getLooper().lock();
     }
 }
 
 void XMessage::clear() {
+    if (mStore == nullptr) {
+        return;
+    }
+    if (mStore.use_count() > 1) {
+        // leave the items to the messages sharing them
+        mStore.reset();
+        return;
+    }
+    atomic_thread_fence(memory_order_acquire);
+    mStore->clear();
+}
+
+XMessage::ItemStore::ItemStore()
+    : mNumItems(0) {
+}
+
+XMessage::ItemStore::~ItemStore() {
+    clear();
+}
+
+void XMessage::ItemStore::clear() {
     for (size_t i = 0; i < mNumItems; ++i) {
         Item *item = &mItems[i];
         delete[] item->mName;
@@ -65,35 +128,102 @@ void XMessage::clear() {
     mNumItems = 0;
 }
 
-void XMessage::deliver() {
-    shared_ptr<XHandler> handler = mHandler.lock();
-    if (handler == NULL) {
-        printf("failed to deliver message as target handler is gone.\n");
-        return;
+inline size_t XMessage::numItems() const {
+    return mStore != nullptr ? mStore->mNumItems : 0;
+}
+
+XMessage::ItemStore *XMessage::editStore() {
+    if (mStore == nullptr) {
+        mStore = make_shared<ItemStore>();
+    } else if (mStore.use_count() > 1) {
+        shared_ptr<ItemStore> store = make_shared<ItemStore>();
+        for (size_t i = 0; i < mStore->mNumItems; ++i) {
+            const Item *from = &mStore->mItems[i];
+            Item *to = &store->mItems[i];
+
+            to->setName(from->mName, from->mNameLength);
+            to->mType = from->mType;
+            if (from->mType == kTypeString) {
+                to->u.stringValue = new string(*from->u.stringValue);
+            } else {
+                to->u = from->u;
+            }
+            store->mNumItems++;
+        }
+        mStore = store;
+    } else {
+        // pairs with the release of the last other owner, whose reads of
+        // the store must be done before we write to it
+        atomic_thread_fence(memory_order_acquire);
     }
+    return mStore.get();
+}
 
-    handler->deliverMessage(mMsg.lock());
+void XMessage::dispatch(XHandler *handler, const shared_ptr<XMessage> &msg) {
+    handler->deliverMessage(msg);
 }
 
 int XMessage::post(int64_t delayUs) {
-    shared_ptr<XLooper> looper = mLooper.lock();
-    if (looper == nullptr) {
-        printf("failed to post message as target looper for handler is gone.\n");
+    if (mLooper == nullptr) {
+        XLOGW("failed to post message as target looper for handler is gone.");
         return -1;
     }
 
-    looper->post(mMsg.lock(), delayUs);
-    return 0;
+    return mLooper->post(mMsg.lock(), delayUs);
+}
+
+int XMessage::postPeriodic(int64_t periodUs, int64_t delayUs) {
+    if (mLooper == nullptr) {
+        XLOGW("failed to post message as target looper for handler is gone.");
+        return -1;
+    }
+
+    return mLooper->postPeriodic(mMsg.lock(), periodUs, delayUs);
+}
+
+int XMessage::postAtMediaTime(XLooper::timeline_id timeline, int64_t mediaUs) {
+    if (mLooper == nullptr) {
+        XLOGW("failed to post message as target looper for handler is gone.");
+        return -1;
+    }
+
+    return mLooper->postAtMediaTime(mMsg.lock(), timeline, mediaUs);
+}
+
+int XMessage::cancelPeriodic() {
+    if (mLooper == nullptr) {
+        return -1;
+    }
+
+    return mLooper->cancelPeriodic(mMsg.lock());
+}
+
+bool XMessage::isTyped() const {
+    return false;
+}
+
+size_t XMessage::payloadSize() const {
+    size_t size = 0;
+    for (size_t i = 0; i < numItems(); ++i) {
+        const Item *item = &mStore->mItems[i];
+        size += sizeof(item->u) + item->mNameLength;
+        if (item->mType == kTypeString) {
+            size += item->u.stringValue->size();
+        }
+    }
+    return size;
 }
 
 inline size_t XMessage::findItemIndex(const char *name, size_t len) const {
     size_t i = 0;
-    for (; i < mNumItems; i++) {
-        if (len != mItems[i].mNameLength) {
+    size_t count = numItems();
+    for (; i < count; i++) {
+        const Item &item = mStore->mItems[i];
+        if (len != item.mNameLength) {
             continue;
         }
 
-        if (!memcmp(mItems[i].mName, name, len)) {
+        if (!memcmp(item.mName, name, len)) {
             break;
         }
     }
@@ -103,25 +233,28 @@ inline size_t XMessage::findItemIndex(const char *name, size_t len) const {
 // assumes item's name was uninitialized or NULL
 void XMessage::Item::setName(const char *name, size_t len) {
     mNameLength = len;
-    mName = new char[len + 1];
-    memcpy((void*)mName, name, len + 1);
+    char *buf = new char[len + 1];
+    memcpy(buf, name, len);
+    buf[len] = '\0';
+    mName = buf;
 }
 
 XMessage::Item *XMessage::allocateItem(const char *name) {
     size_t len = strlen(name);
     size_t i = findItemIndex(name, len);
+    ItemStore *store = editStore();
     Item *item;
 
-    if (i < mNumItems) {
-        item = &mItems[i];
+    if (i < store->mNumItems) {
+        item = &store->mItems[i];
         freeItemValue(item);
     } else {
-        if(mNumItems >= kMaxNumItems)
+        if(store->mNumItems >= kMaxNumItems)
         {
             return NULL;
         }
-        i = mNumItems++;
-        item = &mItems[i];
+        i = store->mNumItems++;
+        item = &store->mItems[i];
         item->mType = kTypeInt32;
         item->setName(name, len);
     }
@@ -129,11 +262,15 @@ XMessage::Item *XMessage::allocateItem(const char *name) {
     return item;
 }
 
+bool XMessage::contains(const char *name) const {
+    return findItemIndex(name, strlen(name)) < numItems();
+}
+
 const XMessage::Item *XMessage::findItem(
         const char *name, Type type) const {
     size_t i = findItemIndex(name, strlen(name));
-    if (i < mNumItems) {
-        const Item *item = &mItems[i];
+    if (i < numItems()) {
+        const Item *item = &mStore->mItems[i];
         return item->mType == type ? item : NULL;
 
     }
@@ -232,32 +369,151 @@ void XMessage::setString(
 }
 
 shared_ptr<XMessage> XMessage::dup() const {
-    shared_ptr<XMessage> msg = XMessage::obtainMsg(mWhat, mHandler.lock());
-    msg->mNumItems = mNumItems;
+    if (isTyped()) {
+        // a plain copy would lose the payload and the handler binding
+        XLOGW("failed to dup a typed message.");
+        return nullptr;
+    }
+    shared_ptr<XMessage> msg = XMessage::obtainMsg(mWhat, nullptr);
+    msg->mPriority = mPriority;
+    msg->mDeadlineUs = mDeadlineUs;
+    msg->mDeadlinePolicy = mDeadlinePolicy;
+    msg->mTarget = mTarget;
+    msg->mLooper = mLooper;
+    // copied by whichever side is changed first
+    msg->mStore = mStore;
 
+    return msg;
+}
 
-    for (size_t i = 0; i < mNumItems; ++i) {
-        const Item *from = &mItems[i];
-        Item *to = &msg->mItems[i];
-
-        to->setName(from->mName, from->mNameLength);
-        to->mType = from->mType;
-
-        switch (from->mType) {
-            case kTypeString:
-            {
-                to->u.stringValue =
-                    new string(*from->u.stringValue);
-                break;
-            }
+namespace {
 
-            default:
-            {
-                to->u = from->u;
-                break;
-            }
+struct EncodedHeader {
+    uint32_t mWhat;
+    uint32_t mNumItems;
+};
+
+struct EncodedItem {
+    uint8_t  mType;
+    uint8_t  mReserved;
+    uint16_t mNameLength;
+    uint32_t mDataLength;   // string bytes following the name
+    uint8_t  mValue[16];    // raw scalar / rect value
+};
+
+inline size_t align8(size_t size) {
+    return (size + 7) & ~(size_t)7;
+}
+
+}  // namespace
+
+// Lengths are stored in the record's 16 and 32 bit fields, pointers are
+// never sent to another address space.
+static bool canEncode(int32_t type, size_t nameLength, size_t dataLength) {
+    return type != XMessage::kTypePointer
+        && nameLength <= UINT16_MAX && dataLength <= UINT32_MAX;
+}
+
+size_t XMessage::encodedSize() const {
+    if (isTyped()) {
+        return 0;
+    }
+    size_t size = sizeof(EncodedHeader);
+    for (size_t i = 0; i < numItems(); ++i) {
+        const Item *item = &mStore->mItems[i];
+        size_t dataLength =
+            item->mType == kTypeString ? item->u.stringValue->size() : 0;
+        if (!canEncode(item->mType, item->mNameLength, dataLength)) {
+            XLOGW("can't encode item %s, a pointer or too long", item->mName);
+            return 0;
+        }
+        size += align8(sizeof(EncodedItem) + item->mNameLength + dataLength);
+    }
+    return size;
+}
+
+size_t XMessage::encode(uint8_t *dst) const {
+    if (isTyped()) {
+        return 0;
+    }
+    for (size_t i = 0; i < numItems(); ++i) {
+        const Item *item = &mStore->mItems[i];
+        if (!canEncode(item->mType, item->mNameLength,
+                item->mType == kTypeString ? item->u.stringValue->size() : 0)) {
+            return 0;
         }
     }
 
+    EncodedHeader *header = (EncodedHeader *)dst;
+    header->mWhat = mWhat;
+    header->mNumItems = 0;
+
+    size_t offset = sizeof(EncodedHeader);
+    for (size_t i = 0; i < numItems(); ++i) {
+        const Item *item = &mStore->mItems[i];
+        EncodedItem *to = (EncodedItem *)(dst + offset);
+        to->mType = (uint8_t)item->mType;
+        to->mReserved = 0;
+        to->mNameLength = (uint16_t)item->mNameLength;
+        to->mDataLength = 0;
+        memset(to->mValue, 0, sizeof(to->mValue));
+
+        uint8_t *data = (uint8_t *)(to + 1);
+        memcpy(data, item->mName, item->mNameLength);
+        data += item->mNameLength;
+
+        if (item->mType == kTypeString) {
+            to->mDataLength = (uint32_t)item->u.stringValue->size();
+            memcpy(data, item->u.stringValue->data(), to->mDataLength);
+        } else {
+            memcpy(to->mValue, &item->u, sizeof(item->u) < sizeof(to->mValue)
+                    ? sizeof(item->u) : sizeof(to->mValue));
+        }
+
+        offset += align8(sizeof(EncodedItem) + to->mNameLength + to->mDataLength);
+        header->mNumItems++;
+    }
+    return offset;
+}
+
+shared_ptr<XMessage> XMessage::decode(
+        const uint8_t *src, size_t size, shared_ptr<XHandler> handler) {
+    if (size < sizeof(EncodedHeader)) {
+        return nullptr;
+    }
+
+    const EncodedHeader *header = (const EncodedHeader *)src;
+    if (header->mNumItems > kMaxNumItems) {
+        return nullptr;
+    }
+
+    shared_ptr<XMessage> msg = XMessage::obtainMsg(header->mWhat, handler);
+    ItemStore *store = header->mNumItems > 0 ? msg->editStore() : NULL;
+
+    size_t offset = sizeof(EncodedHeader);
+    for (uint32_t i = 0; i < header->mNumItems; ++i) {
+        const EncodedItem *from = (const EncodedItem *)(src + offset);
+        if (offset > size || size - offset < sizeof(EncodedItem)
+                || size - offset - sizeof(EncodedItem)
+                        < (size_t)from->mNameLength + from->mDataLength
+                || from->mType > kTypeRect || from->mType == kTypePointer) {
+            return nullptr;
+        }
+
+        const char *data = (const char *)(from + 1);
+        Item *to = &store->mItems[store->mNumItems++];
+        to->setName(data, from->mNameLength);
+        to->mType = (Type)from->mType;
+        data += from->mNameLength;
+
+        if (to->mType == kTypeString) {
+            to->u.stringValue = new string(data, from->mDataLength);
+        } else {
+            memcpy(&to->u, from->mValue, sizeof(to->u) < sizeof(from->mValue)
+                    ? sizeof(to->u) : sizeof(from->mValue));
+        }
+
+        offset += align8(sizeof(EncodedItem) + from->mNameLength + from->mDataLength);
+    }
     return msg;
 }
@@ -25,7 +25,7 @@ class XLooper;
 
 class XMessage
 {
-private:
+protected:
     XMessage();
     XMessage(uint32_t what, shared_ptr<XHandler> handler);
 public:
@@ -38,8 +38,34 @@ public:
 
     void setTarget(shared_ptr<XHandler> handler);
 
+    // Looper lane the message is dispatched in, one of XLooper::Priority.
+    // Defaults to XLooper::kPriorityNormal.
+    void setPriority(int32_t priority);
+    int32_t priority() const;
+
+    // Latest useful delivery time, in the target looper's time (see
+    // XLooper::nowUs()), INT64_MAX for none. Among due messages of a lane the
+    // looper delivers the earliest deadline first, a message without one
+    // counting as due by its own due time. A message whose deadline
+    // has passed by the time its turn comes is delivered with lateUs() set,
+    // or dropped if the policy is XLooper::kDeadlineDrop.
+    void setDeadline(int64_t deadlineUs);
+    int64_t deadlineUs() const;
+    // One of XLooper::DeadlinePolicy, defaults to XLooper::kDeadlineDeliver.
+    void setDeadlinePolicy(int32_t policy);
+    int32_t deadlinePolicy() const;
+    // How far past its deadline the message was delivered, 0 if in time.
+    // Meaningful in the handler.
+    int64_t lateUs() const;
+
     void clear();
     int post(int64_t delayUs = 0);
+    // See XLooper::postPeriodic(), missed ticks are skipped.
+    int postPeriodic(int64_t periodUs, int64_t delayUs = 0);
+    int cancelPeriodic();
+    // See XLooper::postAtMediaTime(), |timeline| is one of the target
+    // looper's timelines.
+    int postAtMediaTime(XLooper::timeline_id timeline, int64_t mediaUs);
     
     void setInt32(const char *name, int32_t value);
     void setInt64(const char *name, int64_t value);
@@ -66,8 +92,26 @@ public:
     bool findRect(const char *name,
             int32_t *left, int32_t *top, int32_t *right, int32_t *bottom) const;
     
+    // Copy sharing the items, nullptr for a typed message.
     shared_ptr<XMessage> dup() const;
 
+    // True for an XTypedMessage: its payload isn't made of items and its
+    // delivery is bound to one handler type.
+    virtual bool isTyped() const;
+
+    // Compact binary form of what() and the items, used to hand messages to
+    // another process (see XSharedMemoryChannel). Scalars are stored as raw
+    // fixed-size records, so decoding is a memcpy per item rather than any
+    // parsing. Both return 0 for a message that can't be encoded: a typed
+    // message, one with a pointer item (meaningless in another address
+    // space), an item name of 64KB or more, or a string of 4GB or more.
+    // decode() returns nullptr for malformed input, pointer items included,
+    // so a peer can't plant an address in a received message.
+    size_t encodedSize() const;
+    size_t encode(uint8_t *dst) const;
+    static shared_ptr<XMessage> decode(
+            const uint8_t *src, size_t size, shared_ptr<XHandler> handler);
+
 
     enum Type {
         kTypeInt32,
@@ -83,13 +127,33 @@ public:
     struct Rect {
         int32_t mLeft, mTop, mRight, mBottom;
     };
+protected:
+    // Hands the message over to |handler| on the looper thread, |msg| is
+    // the queue's reference to this message. Key/value messages go through
+    // onMessageReceived(), XTypedMessage overrides this to call the handler
+    // directly.
+    virtual void dispatch(XHandler *handler, const shared_ptr<XMessage> &msg);
+
+    // Bytes of payload the message holds, used for XLooper queue limits.
+    virtual size_t payloadSize() const;
+
+    weak_ptr<XMessage> mMsg;
+
 private:
     friend class XLooper;
+    friend class XLooperRecorder;
     uint32_t mWhat;
+    int32_t mPriority;
+    int64_t mDeadlineUs;
+    int32_t mDeadlinePolicy;
+    int64_t mLateUs;
     
-    weak_ptr<XHandler> mHandler;
-    weak_ptr<XLooper> mLooper;
-    weak_ptr<XMessage> mMsg;
+    // Target handler id in |mLooper|'s handler table. The looper is held
+    // strongly so post() doesn't promote a weak reference each time, the
+    // reference cycle through a queued message is broken when the handler
+    // is unregistered.
+    int32_t mTarget;
+    shared_ptr<XLooper> mLooper;
     
     struct Item {
         union {
@@ -111,16 +175,28 @@ private:
     enum {
         kMaxNumItems = 64
     };
-    Item mItems[kMaxNumItems];
-    size_t mNumItems;
+
+    // Items are shared between a message and its dup()s, so dup() only takes
+    // a reference. The first set*() on a shared store copies it.
+    struct ItemStore {
+        ItemStore();
+        ~ItemStore();
+        void clear();
+        Item mItems[kMaxNumItems];
+        size_t mNumItems;
+    };
+    // allocated on first set*(), typed messages never pay for it.
+    shared_ptr<ItemStore> mStore;
+
+    size_t numItems() const;
+    // mStore, made private to this message first
+    ItemStore *editStore();
 
     Item *allocateItem(const char *name);
-    void freeItemValue(Item *item);
+    static void freeItemValue(Item *item);
     const Item *findItem(const char *name, Type type) const;
     
     size_t findItemIndex(const char *name, size_t len) const;
-
-    void deliver();
 };
 
 #endif /* XMessage_hpp */
@@ -0,0 +1,156 @@
+//
+//  XRunnable.hpp
+//  foundation
+//
+
+#ifndef XRunnable_hpp
+#define XRunnable_hpp
+
+#include <stddef.h>
+#include <new>
+#include <utility>
+#include <type_traits>
+
+// Move-only holder for a void() callable posted to an XLooper.
+//
+// Callables up to kInlineSize bytes (a lambda capturing a few pointers or
+// integers) are stored in place, only larger ones are moved to the heap.
+class XRunnable
+{
+public:
+    enum {
+        kInlineSize = 6 * sizeof(void *),
+    };
+
+    XRunnable()
+        : mOps(NULL) {}
+
+    template <typename F, typename = typename std::enable_if<
+            !std::is_same<typename std::decay<F>::type, XRunnable>::value>::type>
+    XRunnable(F &&fn)
+        : mOps(NULL) {
+        typedef typename std::decay<F>::type Fn;
+        construct<Fn>(std::forward<F>(fn),
+                std::integral_constant<bool, IsInline<Fn>::value>());
+        mOps = &OpsFor<Fn, IsInline<Fn>::value>::kOps;
+    }
+
+    XRunnable(XRunnable &&other)
+        : mOps(other.mOps) {
+        if (mOps != NULL) {
+            mOps->move(mStorage, other.mStorage);
+            other.mOps = NULL;
+        }
+    }
+
+    XRunnable &operator=(XRunnable &&other) {
+        if (this != &other) {
+            reset();
+            mOps = other.mOps;
+            if (mOps != NULL) {
+                mOps->move(mStorage, other.mStorage);
+                other.mOps = NULL;
+            }
+        }
+        return *this;
+    }
+
+    ~XRunnable() {
+        reset();
+    }
+
+    explicit operator bool() const {
+        return mOps != NULL;
+    }
+
+    void operator()() {
+        mOps->invoke(mStorage);
+    }
+
+    void reset() {
+        if (mOps != NULL) {
+            mOps->destroy(mStorage);
+            mOps = NULL;
+        }
+    }
+
+private:
+    XRunnable(const XRunnable &);
+    XRunnable &operator=(const XRunnable &);
+
+    struct Ops {
+        void (*invoke)(void *storage);
+        // move-constructs into |dst| and destroys |src|
+        void (*move)(void *dst, void *src);
+        void (*destroy)(void *storage);
+    };
+
+    template <typename Fn>
+    struct IsInline {
+        static const bool value = sizeof(Fn) <= kInlineSize
+                && alignof(Fn) <= alignof(max_align_t)
+                && std::is_nothrow_move_constructible<Fn>::value;
+    };
+
+    template <typename Fn, bool Inline>
+    struct OpsFor;
+
+    template <typename Fn, typename F>
+    void construct(F &&fn, std::true_type /* inline */) {
+        new (mStorage) Fn(std::forward<F>(fn));
+    }
+
+    template <typename Fn, typename F>
+    void construct(F &&fn, std::false_type /* inline */) {
+        *reinterpret_cast<Fn **>(mStorage) = new Fn(std::forward<F>(fn));
+    }
+
+    alignas(max_align_t) unsigned char mStorage[kInlineSize];
+    const Ops *mOps;
+};
+
+template <typename Fn>
+struct XRunnable::OpsFor<Fn, true> {
+    static void invoke(void *storage) {
+        (*static_cast<Fn *>(storage))();
+    }
+    static void move(void *dst, void *src) {
+        Fn *from = static_cast<Fn *>(src);
+        new (dst) Fn(std::move(*from));
+        from->~Fn();
+    }
+    static void destroy(void *storage) {
+        static_cast<Fn *>(storage)->~Fn();
+    }
+    static const Ops kOps;
+};
+
+template <typename Fn>
+const XRunnable::Ops XRunnable::OpsFor<Fn, true>::kOps = {
+    &XRunnable::OpsFor<Fn, true>::invoke,
+    &XRunnable::OpsFor<Fn, true>::move,
+    &XRunnable::OpsFor<Fn, true>::destroy,
+};
+
+template <typename Fn>
+struct XRunnable::OpsFor<Fn, false> {
+    static void invoke(void *storage) {
+        (**static_cast<Fn **>(storage))();
+    }
+    static void move(void *dst, void *src) {
+        *static_cast<Fn **>(dst) = *static_cast<Fn **>(src);
+    }
+    static void destroy(void *storage) {
+        delete *static_cast<Fn **>(storage);
+    }
+    static const Ops kOps;
+};
+
+template <typename Fn>
+const XRunnable::Ops XRunnable::OpsFor<Fn, false>::kOps = {
+    &XRunnable::OpsFor<Fn, false>::invoke,
+    &XRunnable::OpsFor<Fn, false>::move,
+    &XRunnable::OpsFor<Fn, false>::destroy,
+};
+
+#endif /* XRunnable_hpp */
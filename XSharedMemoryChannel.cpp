@@ -0,0 +1,328 @@
+//
+//  XSharedMemoryChannel.cpp
+//  foundation
+//
+
+#define LOG_TAG "XSharedMemoryChannel"
+#include "XSharedMemoryChannel.h"
+
+#if defined(__linux__)
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "XLog.h"
+
+static const uint32_t kMagic = 'XShm';
+static const uint32_t kVersion = 1;
+static const uint32_t kWrapMarker = 0xffffffff;
+#define CACHE_LINE 64
+
+struct XSharedMemoryChannel::Header {
+    uint32_t mMagic;
+    uint32_t mVersion;
+    uint64_t mRingSize;
+    uint32_t mBufferCount;
+    uint32_t mBufferSize;
+
+    // written by the sender only
+    alignas(CACHE_LINE) atomic<uint64_t> mWritePos;
+    // written by the receiver only
+    alignas(CACHE_LINE) atomic<uint64_t> mReadPos;
+
+    alignas(CACHE_LINE) atomic<uint32_t> mWakeSeq;
+    atomic<uint32_t> mReceiverWaiting;
+
+    // followed by mBufferCount in-use flags, the ring and the buffer pool
+};
+
+struct RecordHeader {
+    uint32_t mLength;       // payload bytes, or kWrapMarker
+    uint32_t mReserved;
+    int64_t  mWhenUs;
+};
+
+static inline size_t alignUp(size_t size, size_t to) {
+    return (size + to - 1) & ~(to - 1);
+}
+
+static inline size_t flagsOffset() {
+    return alignUp(sizeof(XSharedMemoryChannel::Header), CACHE_LINE);
+}
+
+static inline size_t ringOffset(uint32_t bufferCount) {
+    return alignUp(flagsOffset() + bufferCount * sizeof(atomic<uint32_t>), CACHE_LINE);
+}
+
+static inline size_t buffersOffset(uint32_t bufferCount, uint64_t ringSize) {
+    return alignUp(ringOffset(bufferCount) + ringSize, CACHE_LINE);
+}
+
+static inline atomic<uint32_t> *bufferFlags(XSharedMemoryChannel::Header *header) {
+    return (atomic<uint32_t> *)((uint8_t *)header + flagsOffset());
+}
+
+static int futexWait(atomic<uint32_t> *addr, uint32_t value) {
+    // not FUTEX_PRIVATE_FLAG: the word is shared with the other process
+    return syscall(SYS_futex, addr, FUTEX_WAIT, value, NULL, NULL, 0);
+}
+
+static int futexWake(atomic<uint32_t> *addr) {
+    return syscall(SYS_futex, addr, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+XSharedMemoryChannel::XSharedMemoryChannel()
+    : mHeader(NULL),
+      mRing(NULL),
+      mBuffers(NULL),
+      mMappedSize(0),
+      mReceiving(false) {
+}
+
+XSharedMemoryChannel::~XSharedMemoryChannel() {
+    stopReceiving();
+    if (mHeader != NULL) {
+        munmap(mHeader, mMappedSize);
+    }
+    if (!mUnlinkPath.empty()) {
+        unlink(mUnlinkPath.c_str());
+    }
+}
+
+int XSharedMemoryChannel::map(int fd, size_t size) {
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        return -1;
+    }
+    mHeader = (Header *)addr;
+    mMappedSize = size;
+    return 0;
+}
+
+shared_ptr<XSharedMemoryChannel> XSharedMemoryChannel::create(
+        const char *path, size_t ringSize, uint32_t bufferCount, uint32_t bufferSize) {
+    ringSize = alignUp(ringSize, sizeof(RecordHeader));
+    bufferSize = alignUp(bufferSize, CACHE_LINE);
+    size_t size = buffersOffset(bufferCount, ringSize) + (size_t)bufferCount * bufferSize;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        XLOGE("failed to create %s", path);
+        return nullptr;
+    }
+
+    shared_ptr<XSharedMemoryChannel> channel =
+        shared_ptr<XSharedMemoryChannel>(new XSharedMemoryChannel());
+    if (ftruncate(fd, size) != 0 || channel->map(fd, size) != 0) {
+        XLOGE("failed to map %s", path);
+        close(fd);
+        unlink(path);
+        return nullptr;
+    }
+    close(fd);
+    channel->mUnlinkPath = path;
+
+    Header *header = new (channel->mHeader) Header();
+    header->mRingSize = ringSize;
+    header->mBufferCount = bufferCount;
+    header->mBufferSize = bufferSize;
+    header->mWritePos.store(0);
+    header->mReadPos.store(0);
+    header->mWakeSeq.store(0);
+    header->mReceiverWaiting.store(0);
+    atomic<uint32_t> *flags = bufferFlags(header);
+    for (uint32_t i = 0; i < bufferCount; ++i) {
+        new (&flags[i]) atomic<uint32_t>(0);
+    }
+    header->mVersion = kVersion;
+    atomic_thread_fence(memory_order_release);
+    header->mMagic = kMagic;
+
+    channel->mRing = (uint8_t *)header + ringOffset(bufferCount);
+    channel->mBuffers = (uint8_t *)header + buffersOffset(bufferCount, ringSize);
+    return channel;
+}
+
+shared_ptr<XSharedMemoryChannel> XSharedMemoryChannel::attach(const char *path) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        XLOGE("failed to open %s", path);
+        return nullptr;
+    }
+
+    struct stat st;
+    shared_ptr<XSharedMemoryChannel> channel =
+        shared_ptr<XSharedMemoryChannel>(new XSharedMemoryChannel());
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)
+            || channel->map(fd, st.st_size) != 0) {
+        XLOGE("failed to map %s", path);
+        close(fd);
+        return nullptr;
+    }
+    close(fd);
+
+    Header *header = channel->mHeader;
+    if (header->mMagic != kMagic || header->mVersion != kVersion
+            || buffersOffset(header->mBufferCount, header->mRingSize)
+                + (size_t)header->mBufferCount * header->mBufferSize > channel->mMappedSize) {
+        XLOGE("%s is not a channel", path);
+        return nullptr;
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    channel->mRing = (uint8_t *)header + ringOffset(header->mBufferCount);
+    channel->mBuffers = (uint8_t *)header
+        + buffersOffset(header->mBufferCount, header->mRingSize);
+    return channel;
+}
+
+uint8_t *XSharedMemoryChannel::ringAt(uint64_t pos) const {
+    return mRing + pos % mHeader->mRingSize;
+}
+
+int XSharedMemoryChannel::post(const shared_ptr<XMessage> &msg, int64_t delayUs) {
+    int64_t nowUs = XLooper::GetNowUs();
+    int64_t whenUs = delayUs > 0
+        ? (delayUs > INT64_MAX - nowUs ? INT64_MAX : nowUs + delayUs) : nowUs;
+
+    size_t length = msg->encodedSize();
+    if (length == 0) {
+        return -1;
+    }
+    size_t recordSize = alignUp(sizeof(RecordHeader) + length, sizeof(RecordHeader));
+    uint64_t ringSize = mHeader->mRingSize;
+
+    lock_guard<mutex> autoLock(mPostLock);
+    uint64_t writePos = mHeader->mWritePos.load(memory_order_relaxed);
+    uint64_t readPos = mHeader->mReadPos.load(memory_order_acquire);
+    uint64_t tailRoom = ringSize - writePos % ringSize;
+    uint64_t needed = recordSize + (tailRoom < recordSize ? tailRoom : 0);
+    if (needed > ringSize - (writePos - readPos)) {
+        return -1;
+    }
+
+    if (tailRoom < recordSize) {
+        // records are contiguous, skip the ring's tail
+        ((RecordHeader *)ringAt(writePos))->mLength = kWrapMarker;
+        writePos += tailRoom;
+    }
+
+    // encode straight into the shared segment, no staging copy
+    RecordHeader *record = (RecordHeader *)ringAt(writePos);
+    record->mLength = (uint32_t)length;
+    record->mReserved = 0;
+    record->mWhenUs = whenUs;
+    msg->encode((uint8_t *)(record + 1));
+
+    mHeader->mWritePos.store(writePos + recordSize);
+    mHeader->mWakeSeq.fetch_add(1);
+    if (mHeader->mReceiverWaiting.load() != 0) {
+        futexWake(&mHeader->mWakeSeq);
+    }
+    return 0;
+}
+
+int XSharedMemoryChannel::startReceiving(shared_ptr<XHandler> handler) {
+    if (mReceiving.exchange(true)) {
+        return -1;
+    }
+    mTarget = handler;
+    mReceiveThread = thread(&XSharedMemoryChannel::receive_func, this);
+    return 0;
+}
+
+void XSharedMemoryChannel::stopReceiving() {
+    if (!mReceiving.exchange(false)) {
+        return;
+    }
+    mHeader->mWakeSeq.fetch_add(1);
+    futexWake(&mHeader->mWakeSeq);
+    mReceiveThread.join();
+}
+
+void XSharedMemoryChannel::receive_func() {
+    uint64_t ringSize = mHeader->mRingSize;
+    uint64_t readPos = mHeader->mReadPos.load(memory_order_relaxed);
+    // the sender may still write to the segment, decode from our own copy
+    vector<uint8_t> payload;
+
+    while (mReceiving.load()) {
+        if (mHeader->mWritePos.load() == readPos) {
+            mHeader->mReceiverWaiting.store(1);
+            uint32_t seq = mHeader->mWakeSeq.load();
+            if (mHeader->mWritePos.load() == readPos && mReceiving.load()) {
+                futexWait(&mHeader->mWakeSeq, seq);
+            }
+            mHeader->mReceiverWaiting.store(0);
+            continue;
+        }
+
+        RecordHeader record;
+        memcpy(&record, ringAt(readPos), sizeof(record));
+        uint64_t tailRoom = ringSize - readPos % ringSize;
+        if (record.mLength == kWrapMarker) {
+            readPos += tailRoom;
+            mHeader->mReadPos.store(readPos);
+            continue;
+        }
+
+        // records never wrap and never pass the write position
+        uint64_t recordSize = alignUp(sizeof(RecordHeader) + record.mLength, sizeof(RecordHeader));
+        if (recordSize > tailRoom
+                || recordSize > mHeader->mWritePos.load() - readPos) {
+            XLOGE("corrupt record of %u bytes at %llu, receiving stopped",
+                    record.mLength, (unsigned long long)readPos);
+            break;
+        }
+        payload.resize(record.mLength);
+        memcpy(payload.data(), ringAt(readPos) + sizeof(RecordHeader), record.mLength);
+        readPos += recordSize;
+        mHeader->mReadPos.store(readPos);
+
+        shared_ptr<XMessage> msg = XMessage::decode(
+                payload.data(), payload.size(), mTarget.lock());
+        int64_t whenUs = record.mWhenUs;
+
+        if (msg == nullptr) {
+            XLOGE("dropping malformed record");
+            continue;
+        }
+        msg->post(whenUs - XLooper::GetNowUs());
+    }
+}
+
+void *XSharedMemoryChannel::obtainBuffer(int32_t *index) {
+    atomic<uint32_t> *flags = bufferFlags(mHeader);
+    for (uint32_t i = 0; i < mHeader->mBufferCount; ++i) {
+        uint32_t expected = 0;
+        if (flags[i].load(memory_order_relaxed) == 0
+                && flags[i].compare_exchange_strong(expected, 1)) {
+            *index = (int32_t)i;
+            return mBuffers + (size_t)i * mHeader->mBufferSize;
+        }
+    }
+    return NULL;
+}
+
+void *XSharedMemoryChannel::getBuffer(int32_t index, size_t *size) {
+    if (index < 0 || (uint32_t)index >= mHeader->mBufferCount) {
+        return NULL;
+    }
+    if (size != NULL) {
+        *size = mHeader->mBufferSize;
+    }
+    return mBuffers + (size_t)index * mHeader->mBufferSize;
+}
+
+void XSharedMemoryChannel::releaseBuffer(int32_t index) {
+    if (index < 0 || (uint32_t)index >= mHeader->mBufferCount) {
+        return;
+    }
+    bufferFlags(mHeader)[index].store(0, memory_order_release);
+}
+
+#endif // __linux__
@@ -0,0 +1,85 @@
+//
+//  XSharedMemoryChannel.hpp
+//  foundation
+//
+
+#ifndef XSharedMemoryChannel_hpp
+#define XSharedMemoryChannel_hpp
+
+#include <stdio.h>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include "XHandler.h"
+
+// Posts XMessages from one process to a handler living in another one.
+//
+// The channel is a single shared memory segment holding a ring of encoded
+// messages (see XMessage::encode()) and a pool of fixed-size buffers. The
+// receiving process creates the segment and starts a receiver thread that
+// decodes each record and posts it to its local handler. The sending process
+// attaches to the same segment and post()s; several sender threads are fine,
+// but only one sending process per channel.
+//
+// Payload buffers don't need to travel through the ring: the sender fills a
+// pool buffer in place (obtainBuffer()), sends its index in a message item,
+// and the receiver reads it with getBuffer() and gives it back with
+// releaseBuffer().
+//
+// An idle receiver sleeps on a futex in the segment and is woken by the
+// sender, there is no polling. Linux/Android only.
+class XSharedMemoryChannel
+{
+public:
+    // Receiving side: creates the segment at |path| (e.g. a file under
+    // /dev/shm or the app cache directory) with a ring of |ringSize| bytes
+    // and |bufferCount| buffers of |bufferSize| bytes each.
+    static shared_ptr<XSharedMemoryChannel> create(
+            const char *path, size_t ringSize,
+            uint32_t bufferCount = 0, uint32_t bufferSize = 0);
+    // Sending side: maps the segment created at |path|.
+    static shared_ptr<XSharedMemoryChannel> attach(const char *path);
+
+    virtual ~XSharedMemoryChannel();
+
+    // Sends |msg| to the peer process, where it is posted to the receiving
+    // handler |delayUs| from now. Returns -1 if the ring has no room
+    // or |msg| can't be encoded (see XMessage::encodedSize()).
+    int post(const shared_ptr<XMessage> &msg, int64_t delayUs = 0);
+
+    // Receiving side: decodes incoming records on a dedicated thread and
+    // posts them to |handler|. Records are copied out of the shared segment
+    // before they are looked at, and a record that doesn't fit the ring
+    // stops the receive thread: the sender is broken or hostile.
+    int startReceiving(shared_ptr<XHandler> handler);
+    void stopReceiving();
+
+    // Returns a free pool buffer and its index, or NULL if none is free.
+    void *obtainBuffer(int32_t *index);
+    void *getBuffer(int32_t index, size_t *size);
+    void releaseBuffer(int32_t index);
+
+    // layout of the start of the shared segment
+    struct Header;
+
+private:
+    XSharedMemoryChannel();
+    int map(int fd, size_t size);
+    uint8_t *ringAt(uint64_t pos) const;
+    void receive_func();
+
+    Header *mHeader;
+    uint8_t *mRing;
+    uint8_t *mBuffers;
+    size_t mMappedSize;
+    string mUnlinkPath;
+
+    // serializes local sender threads, the ring itself is single producer
+    mutex mPostLock;
+
+    weak_ptr<XHandler> mTarget;
+    thread mReceiveThread;
+    atomic<bool> mReceiving;
+};
+
+#endif /* XSharedMemoryChannel_hpp */
@@ -0,0 +1,103 @@
+//
+//  XTimeSource.cpp
+//  foundation
+//
+
+#include <chrono>
+#include "XTimeSource.h"
+
+void XTimeSource::waitUntil(
+        unique_lock<mutex> &lock, condition_variable &cond, int64_t whenUs) {
+    if (whenUs == INT64_MAX) {
+        cond.wait(lock);
+        return;
+    }
+    int64_t delayUs = whenUs - nowUs();
+    if (delayUs > 0) {
+        cond.wait_for(lock, chrono::microseconds(delayUs));
+    }
+}
+
+XVirtualTimeSource::XVirtualTimeSource(int64_t startUs, bool autoAdvance)
+    : mNowUs(startUs),
+      mAutoAdvance(autoAdvance),
+      mNotifying(0) {
+}
+
+void XVirtualTimeSource::setAutoAdvance(bool autoAdvance) {
+    mAutoAdvance.store(autoAdvance);
+    advanceBy(0);
+}
+
+int64_t XVirtualTimeSource::nowUs() {
+    return mNowUs.load();
+}
+
+void XVirtualTimeSource::advanceBy(int64_t deltaUs) {
+    advanceTo(mNowUs.load() + deltaUs);
+}
+
+void XVirtualTimeSource::advanceTo(int64_t whenUs) {
+    vector<Waiter> waiters;
+    {
+        lock_guard<mutex> autoLock(mLock);
+        if (whenUs > mNowUs.load()) {
+            mNowUs.store(whenUs);
+        }
+        waiters = mWaiters;
+        ++mNotifying;
+    }
+
+    // taking each looper's lock guarantees a looper that registered before
+    // the clock moved is already waiting, so the wakeup can't be lost
+    for (size_t i = 0; i < waiters.size(); ++i) {
+        lock_guard<mutex> waiterLock(*waiters[i].mLock);
+        waiters[i].mCondition->notify_all();
+    }
+
+    lock_guard<mutex> autoLock(mLock);
+    if (--mNotifying == 0) {
+        mNotifyDoneCondition.notify_all();
+    }
+}
+
+void XVirtualTimeSource::waitUntil(
+        unique_lock<mutex> &lock, condition_variable &cond, int64_t whenUs) {
+    if (whenUs != INT64_MAX && mAutoAdvance.load()) {
+        lock.unlock();
+        advanceTo(whenUs);
+        lock.lock();
+        return;
+    }
+
+    {
+        lock_guard<mutex> autoLock(mLock);
+        if (mNowUs.load() >= whenUs) {
+            return;
+        }
+        Waiter waiter;
+        waiter.mLock = lock.mutex();
+        waiter.mCondition = &cond;
+        mWaiters.push_back(waiter);
+    }
+
+    // woken by a post to the looper or by advanceTo()
+    cond.wait(lock);
+
+    // an advanceTo() still holding our entry must be done with it before
+    // the looper can go away; it needs the looper lock to finish
+    lock.unlock();
+    {
+        unique_lock<mutex> autoLock(mLock);
+        for (size_t i = 0; i < mWaiters.size(); ++i) {
+            if (mWaiters[i].mCondition == &cond) {
+                mWaiters.erase(mWaiters.begin() + i);
+                break;
+            }
+        }
+        while (mNotifying > 0) {
+            mNotifyDoneCondition.wait(autoLock);
+        }
+    }
+    lock.lock();
+}
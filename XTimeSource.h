@@ -0,0 +1,71 @@
+//
+//  XTimeSource.hpp
+//  foundation
+//
+
+#ifndef XTimeSource_hpp
+#define XTimeSource_hpp
+
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+using namespace std;
+
+// Clock an XLooper schedules against and MediaClock reads real time from.
+// Without one they use XLooper::GetNowUs() (steady_clock).
+class XTimeSource
+{
+public:
+    virtual ~XTimeSource() {}
+
+    virtual int64_t nowUs() = 0;
+
+    // Called by a looper holding |lock| when nothing is due before |whenUs|
+    // (INT64_MAX when its queue is empty). Returns once |cond| is signalled
+    // or the source has reached |whenUs|; returning early is fine, the
+    // looper re-checks its queue. The default sleeps in real time.
+    virtual void waitUntil(unique_lock<mutex> &lock, condition_variable &cond, int64_t whenUs);
+};
+
+// Time that only moves when told to, for simulating hours of playback and
+// timer traffic in seconds, deterministically.
+//
+// In auto-advance mode a looper that waits for a deadline jumps the clock
+// straight to it instead of sleeping. This is exact as long as only one
+// looper at a time has pending work; with several busy loopers the clock
+// follows whichever one goes idle first.
+class XVirtualTimeSource : public XTimeSource
+{
+public:
+    explicit XVirtualTimeSource(int64_t startUs = 0, bool autoAdvance = false);
+
+    void setAutoAdvance(bool autoAdvance);
+
+    // Moves the clock forward (never backwards) and wakes every looper
+    // waiting on it.
+    void advanceTo(int64_t whenUs);
+    void advanceBy(int64_t deltaUs);
+
+    virtual int64_t nowUs();
+    virtual void waitUntil(unique_lock<mutex> &lock, condition_variable &cond, int64_t whenUs);
+
+private:
+    struct Waiter {
+        mutex *mLock;
+        condition_variable *mCondition;
+    };
+
+    atomic<int64_t> mNowUs;
+    atomic<bool> mAutoAdvance;
+
+    mutex mLock;
+    vector<Waiter> mWaiters;
+    // advanceTo() calls walking a copy of mWaiters
+    int mNotifying;
+    condition_variable mNotifyDoneCondition;
+};
+
+#endif /* XTimeSource_hpp */
@@ -0,0 +1,160 @@
+//
+//  XTopic.cpp
+//  foundation
+//
+
+#define LOG_TAG "XTopic"
+#include "XTopic.h"
+#include "XHandler.h"
+#include "XMessage.h"
+#include "XLog.h"
+
+XTopic::XTopic()
+    : mSubscribers(new Subscribers()),
+      mReaders(0) {
+}
+
+XTopic::~XTopic() {
+    for (size_t i = 0; i < mRetired.size(); ++i) {
+        delete mRetired[i];
+    }
+    delete mSubscribers.load();
+}
+
+// The reader count is raised before the pointer is loaded and replace_l()
+// swaps the pointer before it reads the count, all sequentially consistent:
+// either the writer sees the reader or the reader sees the new list.
+const XTopic::Subscribers *XTopic::beginRead() const {
+    mReaders.fetch_add(1);
+    return mSubscribers.load();
+}
+
+void XTopic::endRead() const {
+    mReaders.fetch_sub(1);
+}
+
+void XTopic::replace_l(Subscribers *next) {
+    mRetired.push_back(mSubscribers.exchange(next));
+    if (mReaders.load() == 0) {
+        for (size_t i = 0; i < mRetired.size(); ++i) {
+            delete mRetired[i];
+        }
+        mRetired.clear();
+    }
+}
+
+int XTopic::subscribe(const shared_ptr<XHandler> &handler) {
+    if (handler == nullptr) {
+        return -1;
+    }
+    shared_ptr<XLooper> looper = handler->getLooper().lock();
+    XLooper::handler_id id = handler->id();
+    if (looper == nullptr || id == 0) {
+        XLOGW("failed to subscribe as handler is not registered.");
+        return -1;
+    }
+
+    lock_guard<mutex> autoLock(mLock);
+    const Subscribers *current = mSubscribers.load(memory_order_relaxed);
+    unique_ptr<Subscribers> next(new Subscribers());
+    next->reserve(current->size() + 1);
+    bool added = false;
+    for (size_t i = 0; i < current->size(); ++i) {
+        const LooperGroup &group = (*current)[i];
+        // loopers that went away take their subscribers with them
+        if (group.mLooper.expired()) {
+            continue;
+        }
+        next->push_back(group);
+        LooperGroup &copy = next->back();
+        for (size_t j = 0; j < copy.mHandlers.size(); ++j) {
+            if (copy.mHandlers[j] == handler.get()) {
+                if (copy.mLooperKey == looper.get() && (*copy.mIDs)[j] == id) {
+                    return 0;
+                }
+                // a stale entry for a handler since registered elsewhere
+                vector<XLooper::handler_id> ids(*copy.mIDs);
+                ids.erase(ids.begin() + j);
+                copy.mHandlers.erase(copy.mHandlers.begin() + j);
+                copy.mIDs = make_shared<const vector<XLooper::handler_id> >(ids);
+                break;
+            }
+        }
+        if (copy.mHandlers.empty()) {
+            next->pop_back();
+        } else if (copy.mLooperKey == looper.get()) {
+            vector<XLooper::handler_id> ids(*copy.mIDs);
+            ids.push_back(id);
+            copy.mHandlers.push_back(handler.get());
+            copy.mIDs = make_shared<const vector<XLooper::handler_id> >(ids);
+            added = true;
+        }
+    }
+    if (!added) {
+        LooperGroup group;
+        group.mLooper = looper;
+        group.mLooperKey = looper.get();
+        group.mHandlers.push_back(handler.get());
+        group.mIDs = make_shared<const vector<XLooper::handler_id> >(1, id);
+        next->push_back(group);
+    }
+    replace_l(next.release());
+    return 0;
+}
+
+int XTopic::unsubscribe(const shared_ptr<XHandler> &handler) {
+    lock_guard<mutex> autoLock(mLock);
+    unique_ptr<Subscribers> next(new Subscribers(*mSubscribers.load(memory_order_relaxed)));
+    for (size_t i = 0; i < next->size(); ++i) {
+        LooperGroup &group = (*next)[i];
+        for (size_t j = 0; j < group.mHandlers.size(); ++j) {
+            if (group.mHandlers[j] != handler.get()) {
+                continue;
+            }
+            if (group.mHandlers.size() == 1) {
+                next->erase(next->begin() + i);
+            } else {
+                vector<XLooper::handler_id> ids(*group.mIDs);
+                ids.erase(ids.begin() + j);
+                group.mHandlers.erase(group.mHandlers.begin() + j);
+                group.mIDs = make_shared<const vector<XLooper::handler_id> >(ids);
+            }
+            replace_l(next.release());
+            return 0;
+        }
+    }
+    return -1;
+}
+
+size_t XTopic::subscriberCount() const {
+    const Subscribers *subscribers = beginRead();
+    size_t count = 0;
+    for (size_t i = 0; i < subscribers->size(); ++i) {
+        count += (*subscribers)[i].mHandlers.size();
+    }
+    endRead();
+    return count;
+}
+
+int XTopic::publish(const shared_ptr<XMessage> &msg, int64_t delayUs) {
+    if (msg == nullptr) {
+        return -1;
+    }
+    if (msg->isTyped()) {
+        // its dispatch is bound to the target's handler type
+        XLOGW("failed to publish a typed message.");
+        return -1;
+    }
+
+    int err = 0;
+    const Subscribers *subscribers = beginRead();
+    for (size_t i = 0; i < subscribers->size(); ++i) {
+        const LooperGroup &group = (*subscribers)[i];
+        shared_ptr<XLooper> looper = group.mLooper.lock();
+        if (looper == nullptr || looper->publish(msg, group.mIDs, delayUs) != 0) {
+            err = -1;
+        }
+    }
+    endRead();
+    return err;
+}
@@ -0,0 +1,85 @@
+//
+//  XTopic.hpp
+//  foundation
+//
+
+#ifndef XTopic_hpp
+#define XTopic_hpp
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "XLooper.h"
+
+using namespace std;
+
+class XHandler;
+class XMessage;
+
+// Fan-out of one message to every handler subscribed to the topic, for
+// events like a clock discontinuity, end of stream or a config change that
+// several handlers, possibly on several loopers, care about.
+//
+// publish() queues the message itself, not copies: one event per distinct
+// looper, which hands it to that looper's subscribers one after the other
+// in subscription order. Handlers must treat it as read-only and dup() it
+// (cheap, the items are shared) to get a message of their own. lateUs() is
+// not filled in for published messages. Priority and deadline are taken
+// from the message as for post(). XTypedMessage can't be published, its
+// delivery is bound to a single handler type.
+//
+// The subscriber list is an immutable snapshot replaced on each change.
+// publish() reads it without taking any lock: it announces itself in
+// mReaders and loads the snapshot pointer. subscribe()/unsubscribe() swap
+// in a new list under mLock and retire the old one, freed by a later
+// change that finds no publish() in flight, or with the topic.
+class XTopic
+{
+public:
+    XTopic();
+    ~XTopic();
+
+    // |handler| must be registered with a looper. Returns -1 if it isn't,
+    // 0 otherwise, also when already subscribed.
+    int subscribe(const shared_ptr<XHandler> &handler);
+    // Returns -1 if |handler| wasn't subscribed. A handler unregistered
+    // from its looper is no longer delivered to but stays listed until
+    // unsubscribed.
+    int unsubscribe(const shared_ptr<XHandler> &handler);
+    size_t subscriberCount() const;
+
+    // Returns -1 if a subscriber's looper is gone or refused the message
+    // (see XLooper::QueueLimits), the other loopers still get it. -1 for a
+    // typed message, which is not delivered at all.
+    int publish(const shared_ptr<XMessage> &msg, int64_t delayUs = 0);
+
+private:
+    struct LooperGroup {
+        weak_ptr<XLooper> mLooper;
+        XLooper *mLooperKey;
+        // parallel, mHandlers only identifies entries for unsubscribe()
+        vector<XHandler *> mHandlers;
+        shared_ptr<const vector<XLooper::handler_id> > mIDs;
+    };
+    typedef vector<LooperGroup> Subscribers;
+
+    // A reader keeps the list it loaded between the two calls.
+    const Subscribers *beginRead() const;
+    void endRead() const;
+    void replace_l(Subscribers *next);
+
+    // serializes writers, publish() never takes it
+    mutex mLock;
+    atomic<const Subscribers *> mSubscribers;
+    // publish()/subscriberCount() calls between beginRead() and endRead()
+    mutable atomic<uint32_t> mReaders;
+    // replaced lists a reader may still be walking, under mLock
+    vector<const Subscribers *> mRetired;
+
+    XTopic(const XTopic &);
+    XTopic &operator=(const XTopic &);
+};
+
+#endif /* XTopic_hpp */
@@ -0,0 +1,91 @@
+//
+//  XTypedMessage.hpp
+//  foundation
+//
+
+#ifndef XTypedMessage_hpp
+#define XTypedMessage_hpp
+
+#include <utility>
+#include "XMessage.h"
+#include "XHandler.h"
+
+// A message carrying a plain struct instead of key/value items.
+//
+// The receiving handler type |H| is known when the message is obtained, so
+// delivery is bound at compile time to H::onTypedMessage(T &payload): no
+// switch on what(), no findXxx() lookup. Typed and key/value messages share
+// the same looper queue and keep their relative ordering.
+//
+//     struct SeekRequest { int64_t mTimeUs; };
+//
+//     class Player : public XHandler {
+//     public:
+//         void onTypedMessage(SeekRequest &req);
+//         ...
+//     };
+//
+//     XTypedMessage<SeekRequest>::obtainMsg(player, SeekRequest{1000000})->post();
+//
+// onTypedMessage() overloads must be accessible from XTypedMessage, i.e.
+// public, or the handler has to befriend XTypedMessage<T>.
+template <typename T>
+class XTypedMessage : public XMessage
+{
+public:
+    template <typename H>
+    static shared_ptr<XTypedMessage<T> > obtainMsg(shared_ptr<H> handler, T payload) {
+        shared_ptr<XTypedMessage<T> > msg = shared_ptr<XTypedMessage<T> >(
+                new XTypedMessage<T>(handler, &dispatchTo<H>, std::move(payload)));
+        msg->mMsg = msg;
+        return msg;
+    }
+
+    // Rebinds the message to another handler, the dispatch target follows
+    // the new handler type. Don't retarget through XMessage::setTarget().
+    template <typename H>
+    void setTarget(shared_ptr<H> handler) {
+        XMessage::setTarget(handler);
+        mDispatch = &dispatchTo<H>;
+    }
+
+    T &payload() {
+        return mPayload;
+    }
+
+    const T &payload() const {
+        return mPayload;
+    }
+
+    virtual bool isTyped() const {
+        return true;
+    }
+
+private:
+    typedef void (*DispatchFunc)(XHandler *handler, T &payload);
+
+    XTypedMessage(shared_ptr<XHandler> handler, DispatchFunc dispatch, T &&payload)
+        : XMessage(0, handler),
+          mDispatch(dispatch),
+          mPayload(std::move(payload)) {
+    }
+
+    template <typename H>
+    static void dispatchTo(XHandler *handler, T &payload) {
+        static_cast<H *>(handler)->onTypedMessage(payload);
+    }
+
+    virtual void dispatch(XHandler *handler, const shared_ptr<XMessage> &) {
+        mDispatch(handler, mPayload);
+        handler->mMessageCounter++;
+    }
+
+    virtual size_t payloadSize() const {
+        return sizeof(T);
+    }
+
+    DispatchFunc mDispatch;
+    T mPayload;
+};
+
+#endif /* XTypedMessage_hpp */
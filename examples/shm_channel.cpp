@@ -0,0 +1,161 @@
+//
+//  shm_channel.cpp
+//  foundation
+//
+//  Two-process check of XSharedMemoryChannel. Run without arguments it is
+//  the receiver: it creates a channel, starts itself again as the sender,
+//  and checks every message and pool buffer that arrives. Exits 0 when all
+//  of them came through intact.
+//
+//  g++ -std=c++11 -O2 -pthread -I.. ../*.cpp shm_channel.cpp -o shm_channel
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <condition_variable>
+#include "XLooper.h"
+#include "XHandler.h"
+#include "XMessage.h"
+#include "XSharedMemoryChannel.h"
+
+enum {
+    kWhatFrame = 'frme',
+    kWhatDone = 'done',
+};
+
+static const int kMessages = 10000;
+static const uint32_t kBufferSize = 4096;
+
+class Receiver : public XHandler {
+public:
+    Receiver()
+        : mChannel(NULL),
+          mReceived(0),
+          mErrors(0),
+          mDone(false) {}
+
+    XSharedMemoryChannel *mChannel;
+    mutex mLock;
+    condition_variable mCondition;
+    int mReceived;
+    int mErrors;
+    bool mDone;
+
+protected:
+    virtual void onMessageReceived(shared_ptr<XMessage> msg) {
+        if (msg->what() == kWhatDone) {
+            lock_guard<mutex> autoLock(mLock);
+            mDone = true;
+            mCondition.notify_all();
+            return;
+        }
+
+        int32_t seq, index;
+        int64_t pts;
+        string name;
+        bool ok = msg->what() == kWhatFrame
+            && msg->findInt32("seq", &seq)
+            && msg->findInt64("pts", &pts) && pts == seq * 33333LL
+            && msg->findString("name", &name) && name == "frame-" + to_string(seq)
+            && msg->findInt32("buffer", &index);
+        if (ok) {
+            size_t size;
+            const int32_t *data = (const int32_t *)mChannel->getBuffer(index, &size);
+            ok = data != NULL && size >= kBufferSize;
+            for (size_t i = 0; ok && i < kBufferSize / sizeof(int32_t); ++i) {
+                ok = data[i] == seq + (int32_t)i;
+            }
+            mChannel->releaseBuffer(index);
+        }
+
+        lock_guard<mutex> autoLock(mLock);
+        mReceived++;
+        if (!ok) {
+            mErrors++;
+        }
+    }
+};
+
+static int sender(const char *path) {
+    shared_ptr<XSharedMemoryChannel> tx = XSharedMemoryChannel::attach(path);
+    if (tx == nullptr) {
+        return 1;
+    }
+
+    for (int seq = 0; seq < kMessages; ++seq) {
+        int32_t index;
+        int32_t *data;
+        // wait for the receiver to hand buffers back
+        while ((data = (int32_t *)tx->obtainBuffer(&index)) == NULL) {
+            usleep(100);
+        }
+        for (size_t i = 0; i < kBufferSize / sizeof(int32_t); ++i) {
+            data[i] = seq + (int32_t)i;
+        }
+
+        shared_ptr<XMessage> msg = XMessage::obtainMsg();
+        msg->setWhat(kWhatFrame);
+        msg->setInt32("seq", seq);
+        msg->setInt64("pts", seq * 33333LL);
+        msg->setString("name", "frame-" + to_string(seq));
+        msg->setInt32("buffer", index);
+        while (tx->post(msg) != 0) {
+            usleep(100);
+        }
+    }
+
+    shared_ptr<XMessage> done = XMessage::obtainMsg();
+    done->setWhat(kWhatDone);
+    while (tx->post(done) != 0) {
+        usleep(100);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc == 3 && strcmp(argv[1], "send") == 0) {
+        return sender(argv[2]);
+    }
+
+    char path[64];
+    snprintf(path, sizeof(path), "/dev/shm/xlooper-example-%d", (int)getpid());
+    shared_ptr<XSharedMemoryChannel> rx = XSharedMemoryChannel::create(path, 64 << 10, 16, kBufferSize);
+    if (rx == nullptr) {
+        return 1;
+    }
+
+    shared_ptr<XLooper> looper = XLooper::createLooper();
+    looper->setName("receiver");
+    looper->start();
+    shared_ptr<Receiver> receiver = make_shared<Receiver>();
+    receiver->init(receiver);
+    receiver->mChannel = rx.get();
+    looper->registerHandler(receiver.get());
+    rx->startReceiving(receiver);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl(argv[0], argv[0], "send", path, (char *)NULL);
+        _exit(127);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+
+    bool done;
+    {
+        unique_lock<mutex> autoLock(receiver->mLock);
+        done = receiver->mCondition.wait_for(autoLock, chrono::seconds(10),
+                [&receiver] { return receiver->mDone; });
+    }
+    rx->stopReceiving();
+    looper->unregisterHandler(receiver.get());
+    looper->stop();
+
+    printf("sender exit %d, received %d/%d, %d bad\n",
+            WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+            receiver->mReceived, kMessages, receiver->mErrors);
+    return done && status == 0 && receiver->mReceived == kMessages
+        && receiver->mErrors == 0 ? 0 : 1;
+}
@@ -6,11 +6,18 @@ LOCAL_C_INCLUDES += $(LOCAL_PATH)/..
 
 LOCAL_CPPFLAGS += -O2
 
+LOCAL_LDLIBS += -llog
+
 LOCAL_MODULE    := libxlooper
 LOCAL_SRC_FILES := ../XHandler.cpp \
 					../XLooper.cpp \
 					../XMessage.cpp \
-					../XMediaClock.cpp 					
+					../XMediaClock.cpp \
+					../XSharedMemoryChannel.cpp \
+					../XLooperRecorder.cpp \
+					../XTimeSource.cpp \
+					../XLog.cpp \
+					../XTopic.cpp
 					
  
 include $(BUILD_SHARED_LIBRARY)